@@ -0,0 +1,108 @@
+#pragma once
+#include <functional>
+#include <future>
+#include "raytracer.hpp"
+
+// Renders Scene::animation frame by frame with meshes and textures loaded only once.
+// While frame f is traced, a background task poses a spare copy of every animated body for
+// frame f + 1 (transform and k-d tree rebuild) and the previous frame is handed to on_frame;
+// the copies are swapped between frames. After the last frame the scene gets its own bodies back,
+// at their rest transforms.
+struct AnimationRenderer {
+    typedef std::function<void(int frame, const uint8_t *data)> FrameCallback;
+
+    RayTracer &tracer;
+    std::vector<const Animation::BodyTrack *> tracks;
+    std::vector<Body *> original;
+    std::vector<Body *> spare;
+    std::vector<Matrix3x3> rest_w;
+    std::vector<Vector3> rest_b;
+    Camera rest_camera;
+
+    AnimationRenderer(RayTracer &tracer_) : tracer(tracer_), rest_camera(tracer_.scene.camera) {
+        Scene &scene = tracer.scene;
+        for (const Animation::BodyTrack &track : scene.animation.body_tracks) {
+            if (track.body < 0 || track.body >= static_cast<int>(scene.bodies.size())) {
+                fprintf(stderr, "animation track refers to unknown body %d\n", track.body);
+                continue;
+            }
+            // a second track would pose the first one's copy, and lose its original
+            if (std::any_of(tracks.begin(), tracks.end(),
+                            [&](const Animation::BodyTrack *t) { return t->body == track.body; })) {
+                fprintf(stderr, "ignored a second animation track of body %d\n", track.body);
+                continue;
+            }
+            Body *body = scene.bodies[track.body];
+            tracks.push_back(&track);
+            original.push_back(body);
+            rest_w.push_back(body->w);
+            rest_b.push_back(body->b);
+            spare.push_back(body->clone());
+        }
+    }
+
+    ~AnimationRenderer() {
+        for (Body *body : spare) delete body;
+    }
+
+    bool render(int width, int height, const RayTracer::TraceConfig &config, const FrameCallback &on_frame) {
+        Scene &scene = tracer.scene;
+        const int num_frames = scene.animation.num_frames;
+        std::vector<uint8_t> buffers[2];
+        for (auto &buffer : buffers) buffer.assign(static_cast<size_t>(width) * height * 3, 0);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        pose_spare(0);
+        swap_spare();
+        std::future<void> saving;
+        for (int frame = 0; frame < num_frames; ++frame) {
+            scene.camera = scene.animation.camera_at(rest_camera, frame);
+            std::future<void> posing;
+            if (frame + 1 < num_frames)
+                posing = std::async(std::launch::async, [this, frame] { pose_spare(frame + 1); });
+
+            fprintf(stderr, "frame %d/%d: ", frame + 1, num_frames);
+            uint8_t *out = buffers[frame & 1].data();
+            bool success = tracer.render(out, width, height, config);
+            if (posing.valid()) posing.wait();
+            if (saving.valid()) saving.wait();
+            if (!success) break;
+
+            saving = std::async(std::launch::async, [&on_frame, frame, out] { on_frame(frame, out); });
+            swap_spare();
+        }
+        if (saving.valid()) saving.wait();
+        scene.camera = rest_camera;
+        restore();
+
+        auto sec = (std::chrono::high_resolution_clock::now() - start).count() / 1e9;
+        fprintf(stderr, "rendered %d frames in %.3fs (%.3fs per frame)\n", num_frames, sec, sec / num_frames);
+        return !tracer.flag_to_stop;
+    }
+
+private:
+    void pose_spare(int frame) {
+        for (size_t i = 0; i < tracks.size(); ++i)
+            Animation::pose(spare[i], rest_w[i], rest_b[i], *tracks[i], frame);
+    }
+
+    void swap_spare() {
+        for (size_t i = 0; i < tracks.size(); ++i)
+            std::swap(tracer.scene.bodies[tracks[i]->body], spare[i]);
+    }
+
+    // the original bodies back into the scene, posed at rest again if a frame was posed on them
+    void restore() {
+        for (size_t i = 0; i < tracks.size(); ++i) {
+            Body *&slot = tracer.scene.bodies[tracks[i]->body];
+            if (slot != original[i]) std::swap(slot, spare[i]);
+            Body *body = original[i];
+            if (memcmp(body->w.m, rest_w[i].m, sizeof(body->w.m)) != 0 ||
+                memcmp(&body->b, &rest_b[i], sizeof(Vector3)) != 0) {
+                body->w = rest_w[i];
+                body->b = rest_b[i];
+                body->build();
+            }
+        }
+    }
+};
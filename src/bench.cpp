@@ -0,0 +1,237 @@
+#include <string>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <dirent.h>
+#include <sys/resource.h>
+#include "raytracer.hpp"
+
+// Benchmark suite: for every mesh in the resources directory, the time to parse the obj file, the
+// time and memory to build its k-d tree, and the single thread traversal throughput of primary,
+// shadow and random rays; for every scene, the time to load it (from the obj files, without the
+// mesh cache, so that every iteration parses and builds alike and no cache files are left behind)
+// and to render it at fixed settings.
+// Every timing is the best of a few iterations. The results are written as json, so that runs can
+// be compared with each other.
+
+void help() {
+    fputs("usage: ./raytracer-bench [options]\n", stderr);
+    fputs("options:\n", stderr);
+    fputs("   -m <STRING>     directory of the *.obj meshes, default ../resources\n", stderr);
+    fputs("   -s <STRING>     directory of the *.json scenes, default ../scene\n", stderr);
+    fputs("   -n <INT>        rays per traversal test, default 262144\n", stderr);
+    fputs("   -i <INT>        iterations of every test, of which the fastest counts, default 3\n", stderr);
+    fputs("   -w <INT>        render width, default 400\n", stderr);
+    fputs("   -h <INT>        render height, default 300\n", stderr);
+    fputs("   -j <INT>        number of render workers, default all cores\n", stderr);
+    fputs("   -o <STRING>     path to output json, default stdout\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+// sorted paths of the files in dir ending with ext
+std::vector<std::string> list_files(const std::string &dir, const char *ext) {
+    std::vector<std::string> paths;
+    DIR *d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr, "failed to open directory: %s\n", dir.c_str());
+        return paths;
+    }
+    while (dirent *e = readdir(d))
+        if (has_extension(e->d_name, ext)) paths.push_back(dir + "/" + e->d_name);
+    closedir(d);
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+double seconds_since(std::chrono::high_resolution_clock::time_point start) {
+    return (std::chrono::high_resolution_clock::now() - start).count() / 1e9;
+}
+
+// fastest of num_iteration runs of func, in seconds
+template <typename Func>
+double best_of(int num_iteration, const Func &func) {
+    double best = std::numeric_limits<double>::infinity();
+    for (int i = 0; i < num_iteration; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        func();
+        best = std::min(best, seconds_since(start));
+    }
+    return best;
+}
+
+json traverse(const KDTree &kdtree, const std::vector<Ray> &rays, int num_iteration) {
+    size_t num_hit = 0;
+    const double sec = best_of(num_iteration, [&] {
+        num_hit = 0;
+        for (const Ray &ray : rays)
+            if (kdtree.find_nearest(ray).hit != IntersectionResult::MISS) ++num_hit;
+    });
+    return {{"rays", rays.size()}, {"hits", num_hit}, {"seconds", sec},
+            {"mrays_per_second", sec > 0 ? rays.size() / sec / 1e6 : 0.}};
+}
+
+json bench_mesh(const std::string &path, int num_ray, int num_iteration) {
+    ObjMesh mesh;
+    const double load_seconds = best_of(num_iteration, [&] {
+        mesh = ObjMesh();
+        mesh.load(path.c_str());
+    });
+    if (mesh.num_triangles() == 0) return nullptr;
+    Body body;
+    body.set_mesh(mesh);
+
+    // scale into a sphere at the origin, so that the rays are alike for every mesh, and large enough
+    // that the triangle test, which compares the triangle area against EPS, keeps all triangles
+    const float radius = 10;
+    const float inf = std::numeric_limits<float>::infinity();
+    Vector3 lo(inf, inf, inf), hi(-inf, -inf, -inf);
+    for (const Vector3 &p : body.points) lo = min(lo, p), hi = max(hi, p);
+    const float k = 2 * radius / std::max((hi - lo).length(), EPS);
+    body.w = Matrix3x3::scale(k);
+    body.b = -(lo + hi) * .5f * k;
+    lo = (lo - hi) * .5f * k, hi = -lo;
+
+    const double build_seconds = best_of(num_iteration, [&] { body.build(); });
+    const size_t mesh_bytes = body.points.size() * sizeof(Vector3) + body.point_normals.size() * sizeof(Vector3) +
+                              body.vertices.size() * sizeof(Vertex) + body.triangles.size() * sizeof(Triangle);
+
+    // the rays are made before timing, from a fixed seed so that every run traces the same ones
+    const Vector3 extent = hi - lo;
+    std::mt19937 rng(2017);
+    std::uniform_real_distribution<float> uniform(0.f, 1.f);
+
+    // primary: a square grid over the bounding sphere, from a camera in front of it
+    const int side = std::max(1, static_cast<int>(sqrtf(static_cast<float>(num_ray))));
+    const Vector3 eye(0, 0, -3 * radius);
+    std::vector<Ray> primary;
+    for (int y = 0; y < side; ++y)
+        for (int x = 0; x < side; ++x)
+            primary.emplace_back(eye, Vector3((2.f * (x + .5f) / side - 1) * radius,
+                                              (1 - 2.f * (y + .5f) / side) * radius, 0) - eye);
+
+    // shadow: from the primary hits toward a point light above and in front of the mesh
+    const Vector3 light(0, 3 * radius, -3 * radius);
+    std::vector<Ray> shadow;
+    for (const Ray &ray : primary) {
+        const FindNearestResult hit = body.kdtree.find_nearest(ray);
+        if (hit.hit == IntersectionResult::MISS) continue;
+        const Vector3 p = ray.origin + ray.direction * hit.distance;
+        const Vector3 L = (light - p).normalized();
+        shadow.emplace_back(p + L * EPS, L);
+    }
+
+    // random: origins in the bounding box, directions on the unit sphere
+    std::vector<Ray> random;
+    for (int i = 0; i < side * side; ++i) {
+        const Vector3 o = lo + Vector3(extent.x * uniform(rng), extent.y * uniform(rng), extent.z * uniform(rng));
+        const float z = 2 * uniform(rng) - 1, phi = 2 * static_cast<float>(M_PI) * uniform(rng);
+        const float r = sqrtf(std::max(0.f, 1 - z * z));
+        random.emplace_back(o, Vector3(r * cosf(phi), r * sinf(phi), z));
+    }
+
+    return {{"file", path},
+            {"triangles", body.triangles.size()},
+            {"load_seconds", load_seconds},
+            {"build_seconds", build_seconds},
+            {"kdtree_nodes", body.kdtree.num_nodes},
+            {"kdtree_bytes", body.kdtree.memory_bytes()},
+            {"mesh_bytes", mesh_bytes},
+            {"primary", traverse(body.kdtree, primary, num_iteration)},
+            {"shadow", traverse(body.kdtree, shadow, num_iteration)},
+            {"random", traverse(body.kdtree, random, num_iteration)}};
+}
+
+json bench_scene(const std::string &path, int width, int height, const TraceConfig &config, int num_iteration) {
+    RayTracer tracer;
+    json j;
+    std::ifstream fin(path);
+    fin >> j;
+    const double load_seconds = best_of(num_iteration, [&] {
+        tracer.scene.clear();
+        tracer.scene.from_json(j, false);
+    });
+    std::vector<uint8_t> image(static_cast<size_t>(width) * height * 3);
+    const double render_seconds = best_of(num_iteration, [&] {
+        srand(0);
+        tracer.render(image.data(), width, height, config);
+    });
+    const uint64_t rays = tracer.stats.total_rays();
+    return {{"file", path},
+            {"load_seconds", load_seconds},
+            {"render_seconds", render_seconds},
+            {"rays", rays},
+            {"mrays_per_second", tracer.stats_seconds > 0 ? rays / tracer.stats_seconds / 1e6 : 0.},
+            {"kd_nodes_per_ray", rays ? static_cast<double>(tracer.stats.kd_nodes) / rays : 0.}};
+}
+
+int main(int argc, char** argv) {
+    std::string mesh_dir = "../resources", scene_dir = "../scene";
+    const char *out = nullptr;
+    int num_ray = 1 << 18, num_iteration = 3, width = 400, height = 300;
+    TraceConfig config;
+    config.num_worker = std::max(1u, std::thread::hardware_concurrency());
+    config.collect_stats = true;
+
+    if (argc % 2 != 1) help();
+    for (int i = 1; i < argc; i += 2) {
+        std::string key = argv[i];
+        const char *value = argv[i+1];
+        if (key == "-m") {
+            mesh_dir = value;
+        } else if (key == "-s") {
+            scene_dir = value;
+        } else if (key == "-n") {
+            num_ray = std::max(1, std::atoi(value));
+        } else if (key == "-i") {
+            num_iteration = std::max(1, std::atoi(value));
+        } else if (key == "-w") {
+            width = std::atoi(value);
+        } else if (key == "-h") {
+            height = std::atoi(value);
+        } else if (key == "-j") {
+            config.num_worker = std::atoi(value);
+        } else if (key == "-o") {
+            out = value;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            help();
+        }
+    }
+
+    json meshes = json::array();
+    for (const std::string &path : list_files(mesh_dir, ".obj")) {
+        fprintf(stderr, "mesh %s\n", path.c_str());
+        json result = bench_mesh(path, num_ray, num_iteration);
+        if (!result.is_null()) meshes.push_back(result);
+    }
+    json scenes = json::array();
+    for (const std::string &path : list_files(scene_dir, ".json")) {
+        fprintf(stderr, "scene %s\n", path.c_str());
+        scenes.push_back(bench_scene(path, width, height, config, num_iteration));
+    }
+
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    json result = {{"settings", {{"rays_per_test", num_ray},
+                                 {"iterations", num_iteration},
+                                 {"render_width", width},
+                                 {"render_height", height},
+                                 {"render_workers", config.num_worker},
+                                 {"trace_depth", config.num_trace_depth},
+                                 {"diffuse_reflect_samples", config.num_diffuse_reflect_sample},
+                                 {"light_samples_per_unit", config.num_light_sample_per_unit}}},
+                   {"meshes", meshes},
+                   {"scenes", scenes},
+                   {"peak_rss_bytes", static_cast<int64_t>(usage.ru_maxrss) * 1024}};
+    if (out) {
+        std::ofstream fout(out);
+        fout << std::setw(4) << result << std::endl;
+        if (!fout) {
+            fprintf(stderr, "failed to write: %s\n", out);
+            return EXIT_FAILURE;
+        }
+    } else {
+        std::cout << std::setw(4) << result << std::endl;
+    }
+}
@@ -2,6 +2,7 @@
 #include <fstream>
 #include <iomanip>
 #include "raytracer.hpp"
+#include "animation.hpp"
 #include "test_scene.hpp"
 
 void help() {
@@ -13,20 +14,47 @@ void help() {
     fputs("   -r <INT>        number of diffuse reflect samples\n", stderr);
     fputs("   -l <FLOAT>      number of light samples per unit volume\n", stderr);
     fputs("   -j <INT>        number of thread workers\n", stderr);
-    fputs("   -o <STRING>     path to output png image\n", stderr);
+    fputs("   -k <INT>        number of lights picked per shading point from the light tree, 0 (default) for all lights\n", stderr);
+    fputs("   -i <STRING>     integrator: recursive (default) or wavefront\n", stderr);
+    fputs("   -s <INT>        1 to sort bounce rays by direction and origin before tracing (wavefront only)\n", stderr);
+    fputs("   -c <INT>        0 to test every shadow ray against the whole scene instead of its light's last occluder first\n", stderr);
+    fputs("   -e <FLOAT>      irradiance cache error for diffuse reflection, e.g. 0.3; 0 (default) samples every hit (recursive only)\n", stderr);
+    fputs("   -n <INT>        number of edge-aware denoising passes over the finished image, e.g. 5; 0 (default) for none\n", stderr);
+    fputs("   -o <STRING>     path to output png (or binary *.ppm, float *.pfm) image, a printf pattern like frame%04d.png for animations, default /tmp/ray-tracing.png\n", stderr);
+    fputs("   -z <INT>        png compression level, 0 (fastest) to 9 (smallest), default 6\n", stderr);
+    fputs("   -p <STRING>     png row filter: none, sub, up, average, paeth or adaptive (default)\n", stderr);
+    fputs("   -x <INT,INT,INT,INT>  only trace the pixels x0,y0,x1,y1 (x1, y1 exclusive) of the frame, and save them as a cropped image\n", stderr);
+    fputs("   -b <STRING>     with -x: png image of the full frame to draw the traced pixels into and save instead\n", stderr);
+    fputs("   -t <STRING>     per pixel cost to write next to the image as *_cost.png heatmap and *_cost.pfm raw floats: time (ns), nodes (k-d tree nodes visited) or rays\n", stderr);
+    fputs("   -a <STRING>     record every ray traced into this file, to fire them again with raytracer-replay\n", stderr);
+    fputs("   -m <STRING>     back the framebuffer with a scratch file at this path instead of memory\n", stderr);
     fputs("   -f <STRING>     path to scene json\n", stderr);
+    fputs("   --stats         count the rays of every kind, k-d tree nodes visited, triangles tested and light samples\n", stderr);
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
     int width = 800, height = 600;
-    const char *out = "/tmp/ray-tracing.ppm";
+    const char *out = "/tmp/ray-tracing.png";
     const char *filename;
+    const char *scratch = nullptr;
+    const char *base = nullptr;
+    const char *capture = nullptr;
+    RayTracer::Window crop = {0, 0, 0, 0};
+    bool cropped = false;
+    EncodeOptions encode;
     RayTracer::TraceConfig config;
 
-    if (argc % 2 != 1 || argc == 1) help();
+    if (argc == 1) help();
     for (int i = 1; i < argc; i += 2) {
         std::string key = argv[i];
+        // options without a value
+        if (key == "--stats") {
+            config.collect_stats = true;
+            --i;
+            continue;
+        }
+        if (i + 1 >= argc) help();
         const char *value = argv[i+1];
         if (key == "-w") {
             width = std::atoi(value);
@@ -40,8 +68,39 @@ int main(int argc, char** argv) {
             config.num_light_sample_per_unit = static_cast<float>(std::atof(value));
         } else if (key == "-j") {
             config.num_worker = std::atoi(value);
+        } else if (key == "-k") {
+            config.num_light_pick = std::atoi(value);
+        } else if (key == "-i") {
+            config.wavefront = std::string(value) == "wavefront";
+            if (!config.wavefront && std::string(value) != "recursive")
+                fprintf(stderr, "unknown integrator %s\n", value);
+        } else if (key == "-s") {
+            config.sort_secondary = std::atoi(value) != 0;
+        } else if (key == "-c") {
+            config.shadow_cache = std::atoi(value) != 0;
+        } else if (key == "-e") {
+            config.irradiance_cache_error = static_cast<float>(std::atof(value));
+        } else if (key == "-n") {
+            config.denoise_passes = std::atoi(value);
         } else if (key == "-o") {
             out = value;
+        } else if (key == "-z") {
+            encode.compression_level = std::atoi(value);
+        } else if (key == "-p") {
+            if (!EncodeOptions::parse_filter(value, encode.filter))
+                fprintf(stderr, "unknown png filter %s\n", value);
+        } else if (key == "-x") {
+            cropped = sscanf(value, "%d,%d,%d,%d", &crop.x0, &crop.y0, &crop.x1, &crop.y1) == 4;
+            if (!cropped) fprintf(stderr, "invalid crop window %s\n", value);
+        } else if (key == "-b") {
+            base = value;
+        } else if (key == "-t") {
+            if (!TraceConfig::parse_cost_metric(value, config.cost_metric))
+                fprintf(stderr, "unknown cost metric %s\n", value);
+        } else if (key == "-a") {
+            capture = value;
+        } else if (key == "-m") {
+            scratch = value;
         } else if (key == "-f") {
             filename = value;
         } else {
@@ -49,8 +108,6 @@ int main(int argc, char** argv) {
         }
     }
 
-    uint8_t *data = new uint8_t[width * height * 3];
-    memset(data, 0, sizeof(*data) * (width * height * 3));
     RayTracer tracer;
     std::ifstream fin(filename);
     json j;
@@ -64,15 +121,136 @@ int main(int argc, char** argv) {
     printf("========== scene information ==========\n");
     printf("                primitives    %d\n", cnt_primitive);
     printf("                 triangles    %d\n", cnt_triangle);
+    if (config.collect_stats) {
+        for (size_t i = 0; i < tracer.scene.bodies.size(); ++i) {
+            const Body *body = tracer.scene.bodies[i];
+            if (body->build_seconds > 0)
+                printf("%21s %-4zu    %zu triangles, loaded in %.3fs, built in %.3fs\n", "body", i,
+                       body->triangles.size(), body->load_seconds, body->build_seconds);
+            else
+                printf("%21s %-4zu    %zu triangles, loaded from the mesh cache in %.3fs\n", "body", i,
+                       body->triangles.size(), body->load_seconds);
+        }
+    }
     printf("=========== render settings ===========\n");
     printf("                     width    %d\n", width);
     printf("                    height    %d\n", height);
+    if (cropped)
+        printf("               crop window    %d,%d - %d,%d\n", crop.x0, crop.y0, crop.x1, crop.y1);
     printf("               trace depth    %d\n", config.num_trace_depth);
     printf("   diffuse reflect samples    %d\n", config.num_diffuse_reflect_sample);
     printf("  light samples per volume    %.3f\n", config.num_light_sample_per_unit);
     printf("                   workers    %d\n", config.num_worker);
+    if (config.num_light_pick > 0)
+        printf("  lights per shading point    %d of %zu\n", config.num_light_pick, tracer.scene.lights.size());
+    printf("                integrator    %s%s\n", config.wavefront ? "wavefront" : "recursive",
+           config.wavefront && config.sort_secondary ? ", sorted bounce rays" : "");
+    if (config.denoise_passes > 0)
+        printf("            denoise passes    %d\n", config.denoise_passes);
+    if (config.irradiance_cache_error > 0 && !config.wavefront)
+        printf("    irradiance cache error    %.3f\n", config.irradiance_cache_error);
+
+    if (tracer.scene.animation.num_frames > 0) {
+        printf("                    frames    %d\n", tracer.scene.animation.num_frames);
+        std::string pattern = out;
+        if (pattern.find('%') == std::string::npos) {
+            size_t dot = pattern.rfind('.');
+            if (dot == std::string::npos || pattern.find('/', dot) != std::string::npos) dot = pattern.size();
+            pattern.insert(dot, "_%04d");
+        }
+        if (cropped) fprintf(stderr, "the crop window is ignored for animations\n");
+        if (config.cost_metric != TraceConfig::COST_NONE) fprintf(stderr, "no cost heatmap for animations\n");
+        if (capture) fprintf(stderr, "no ray capture for animations\n");
+        AnimationRenderer animation(tracer);
+        animation.render(width, height, config, [&](int frame, const uint8_t *frame_data) {
+            char path[4096];
+            snprintf(path, sizeof(path), pattern.c_str(), frame);
+            std::unique_ptr<ImageWriter> writer = ImageWriter::open(path, width, height, encode);
+            if (!writer || !writer->write_rows(frame_data, height) || !writer->close())
+                fprintf(stderr, "failed to save image to: %s\n", path);
+        });
+    } else {
+        // the whole frame, or the crop window: as an image of its own, or drawn into the base image
+        RayTracer::Window window = {0, 0, width, height};
+        if (cropped) {
+            window.x0 = std::max(crop.x0, 0), window.y0 = std::max(crop.y0, 0);
+            window.x1 = std::min(crop.x1, width), window.y1 = std::min(crop.y1, height);
+            if (window.x1 <= window.x0 || window.y1 <= window.y0) {
+                fprintf(stderr, "crop window is outside the frame\n");
+                return EXIT_FAILURE;
+            }
+        }
+        const bool into_base = cropped && base;
+        const int image_width = into_base ? width : window.x1 - window.x0;
+        const int image_height = into_base ? height : window.y1 - window.y0;
 
-    tracer.render(data, width, height, config);
-    save_png(out, data, width, height);
-    delete [] data;
+        Framebuffer framebuffer;
+        bool allocated = scratch ? framebuffer.allocate_file(scratch, image_width, image_height)
+                                 : framebuffer.allocate(image_width, image_height);
+        if (!allocated) {
+            fprintf(stderr, "failed to allocate framebuffer\n");
+            return EXIT_FAILURE;
+        }
+        if (into_base) {
+            std::vector<uint8_t> rgb;
+            int base_width, base_height;
+            if (!read_png_file(base, rgb, base_width, base_height) || base_width != width || base_height != height) {
+                fprintf(stderr, "failed to read a %dx%d png image from: %s\n", width, height, base);
+                return EXIT_FAILURE;
+            }
+            std::copy(rgb.begin(), rgb.end(), framebuffer.data);
+        }
+        std::unique_ptr<ImageWriter> writer = ImageWriter::open(out, image_width, image_height, encode);
+        if (!writer) {
+            fprintf(stderr, "failed to open output image: %s\n", out);
+            return EXIT_FAILURE;
+        }
+        if (capture && !RayCapture::open(capture, cnt_primitive, cnt_triangle)) {
+            fprintf(stderr, "failed to open ray capture: %s\n", capture);
+            return EXIT_FAILURE;
+        }
+        bool ok = true;
+        if (into_base) {
+            tracer.render(framebuffer.row(window.y0) + window.x0 * 3, width, width, height, window, config);
+            ok = writer->write_rows(framebuffer.data, height);
+        } else {
+            // finished bands go straight to disk and their pages are dropped
+            tracer.render(framebuffer.data, image_width, width, height, window, config, [&](int y0, int y1) {
+                ok = ok && writer->write_rows(framebuffer.row(y0), y1 - y0);
+                framebuffer.release_rows(y0, y1);
+            });
+        }
+        if (!writer->close() || !ok)
+            fprintf(stderr, "failed to save image to: %s\n", out);
+        if (config.irradiance_cache_error > 0 && !config.wavefront)
+            printf("    irradiance records    %zu\n", tracer.irradiance_cache.size());
+        if (capture) {
+            uint64_t num_captured = 0;
+            if (RayCapture::close(&num_captured))
+                printf("             captured rays    %llu\n", static_cast<unsigned long long>(num_captured));
+            else
+                fprintf(stderr, "failed to write ray capture: %s\n", capture);
+        }
+        if (config.cost_metric != TraceConfig::COST_NONE) {
+            // next to the image, of the window only
+            std::string stem = out;
+            const size_t dot = stem.rfind('.');
+            if (dot != std::string::npos && stem.find('/', dot) == std::string::npos) stem.resize(dot);
+            const int w = window.x1 - window.x0, h = window.y1 - window.y0;
+            std::vector<uint8_t> rgb(static_cast<size_t>(w) * h * 3);
+            float top;
+            heatmap(tracer.cost.data(), w, h, rgb.data(), top);
+            save_png((stem + "_cost.png").c_str(), rgb.data(), w, h, encode);
+            if (!save_pfm_gray((stem + "_cost.pfm").c_str(), tracer.cost.data(), w, h))
+                fprintf(stderr, "failed to save cost to: %s_cost.pfm\n", stem.c_str());
+            static const char *const units[] = {"", "ns", "k-d tree nodes", "rays"};
+            const float max = *std::max_element(tracer.cost.begin(), tracer.cost.end());
+            printf("            cost per pixel    0 (black) .. %.0f %s (red), log scale; max %.0f\n", top,
+                   units[config.cost_metric], max);
+        }
+        if (config.collect_stats) {
+            printf("=========== render statistics ===========\n");
+            fputs(tracer.stats.report(tracer.stats_seconds).c_str(), stdout);
+        }
+    }
 }
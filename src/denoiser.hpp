@@ -0,0 +1,130 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <vector>
+#include "geometry.hpp"
+
+// Features of the primary hit of every pixel, which render writes alongside the color when the
+// image is denoised. The denoiser uses them to tell edges from noise.
+struct AuxBuffers {
+    int width = 0, height = 0;
+    std::vector<Color> albedo;      // surface color at the hit, with texture; 1 for lights and misses
+    std::vector<Vector3> normal;    // zero for lights and misses
+    std::vector<float> depth;       // distance along the primary ray, infinity for misses
+    std::vector<uint32_t> object;   // Scene::object_id of the hit
+
+    void resize(int width_, int height_) {
+        width = width_, height = height_;
+        const size_t n = static_cast<size_t>(width) * height;
+        albedo.assign(n, Color(1, 1, 1));
+        normal.assign(n, Vector3(0, 0, 0));
+        depth.assign(n, std::numeric_limits<float>::infinity());
+        object.assign(n, 0);
+    }
+
+    // pixel i: ray hit primitive at distance, or nothing if primitive is nullptr
+    void set(size_t i, const Scene &scene, const Ray &ray, const Primitive *primitive, float distance) {
+        if (!primitive) {
+            albedo[i] = Color(1, 1, 1), normal[i] = Vector3(0, 0, 0);
+            depth[i] = std::numeric_limits<float>::infinity(), object[i] = 0;
+            return;
+        }
+        depth[i] = distance;
+        object[i] = scene.object_id(primitive);
+        if (primitive->light) {
+            albedo[i] = Color(1, 1, 1), normal[i] = Vector3(0, 0, 0);
+            return;
+        }
+        const Vector3 pi = ray.origin + ray.direction * distance;
+        const Vector3 N = primitive->get_normal(pi);
+        normal[i] = N;
+        if (primitive->material.texture) {
+            const float footprint = ray.cone_width_at(distance) / std::max(fabsf(N.dot(ray.direction)), 1e-2f);
+            albedo[i] = primitive->get_color(pi, footprint);
+        } else {
+            albedo[i] = primitive->material.color;
+        }
+    }
+};
+
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Every pass blurs with a 5x5 B3
+// spline kernel whose taps are 2^pass pixels apart, so five passes reach over a footprint 125 pixels
+// wide for the cost of 125 taps per pixel, 25 per pass. Taps are weighted down by the differences
+// in color, normal and depth to the center pixel and dropped on other objects. The filter runs on
+// the color divided by the albedo, so that textures stay sharp, and the albedo is multiplied back
+// afterwards.
+struct Denoiser {
+    float sigma_color = 1.f;    // halved with every pass, as the color gets smoother
+    float sigma_normal = .1f;   // of 1 - cos of the angle between normals
+    float sigma_depth = .1f;    // of the relative depth difference per pixel of distance
+
+    void denoise(std::vector<Color> &color, const AuxBuffers &aux, int passes, int num_threads) const {
+        const int width = aux.width, height = aux.height;
+        const size_t n = static_cast<size_t>(width) * height;
+        std::vector<Color> cur(n), next(n);
+        for (size_t i = 0; i < n; ++i) cur[i] = color[i] / max(aux.albedo[i], Color(1e-3f, 1e-3f, 1e-3f));
+
+        for (int pass = 0; pass < passes; ++pass) {
+            const int step = 1 << pass;
+            const float inv_sigma_color2 = 1 / (sigma_color * sigma_color / static_cast<float>(1 << (2 * pass)));
+            parallel_rows(height, num_threads, [&](int y) {
+                for (int x = 0; x < width; ++x)
+                    next[static_cast<size_t>(y) * width + x] = filter(cur, aux, x, y, step, inv_sigma_color2);
+            });
+            std::swap(cur, next);
+        }
+
+        for (size_t i = 0; i < n; ++i) color[i] = cur[i] * max(aux.albedo[i], Color(1e-3f, 1e-3f, 1e-3f));
+    }
+
+private:
+    Color filter(const std::vector<Color> &c, const AuxBuffers &aux, int x, int y, int step,
+                 float inv_sigma_color2) const {
+        static const float kernel[5] = {1.f / 16, 1.f / 4, 3.f / 8, 1.f / 4, 1.f / 16};
+        const int width = aux.width, height = aux.height;
+        const size_t p = static_cast<size_t>(y) * width + x;
+        const uint32_t object = aux.object[p];
+        const Vector3 &normal = aux.normal[p];
+        const float depth = aux.depth[p];
+        const bool has_depth = depth < std::numeric_limits<float>::infinity();
+        Color sum(0, 0, 0);
+        float sum_weight = 0;
+        for (int dy = -2; dy <= 2; ++dy) {
+            const int qy = y + dy * step;
+            if (qy < 0 || qy >= height) continue;
+            for (int dx = -2; dx <= 2; ++dx) {
+                const int qx = x + dx * step;
+                if (qx < 0 || qx >= width) continue;
+                const size_t q = static_cast<size_t>(qy) * width + qx;
+                if (aux.object[q] != object) continue;
+                const Color d = c[q] - c[p];
+                float e = d.length2() * inv_sigma_color2;
+                e += std::max(0.f, 1 - normal.dot(aux.normal[q])) / sigma_normal;
+                if (has_depth) {
+                    const float distance = step * std::sqrt(static_cast<float>(dx * dx + dy * dy));
+                    e += fabsf(aux.depth[q] - depth) / (sigma_depth * depth * distance + 1e-6f);
+                }
+                const float w = kernel[dx + 2] * kernel[dy + 2] * expf(-e);
+                sum += c[q] * w;
+                sum_weight += w;
+            }
+        }
+        return sum / sum_weight;
+    }
+
+    template <typename Func>
+    static void parallel_rows(int height, int num_threads, const Func &func) {
+        num_threads = std::max(1, std::min(num_threads, height));
+        std::vector<std::thread> threads;
+        auto run = [&](int t) {
+            for (int y = t; y < height; y += num_threads) func(y);
+        };
+        for (int t = 1; t < num_threads; ++t) threads.emplace_back(run, t);
+        run(0);
+        for (auto &t : threads) t.join();
+    }
+};
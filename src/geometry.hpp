@@ -1,11 +1,24 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
+#include <unordered_map>
 #include <png.h>
 #include <json.hpp>
+#include "image.hpp"
+#include "obj_parser.hpp"
+#include "simd.hpp"
+#include "task_pool.hpp"
 
 using nlohmann::json;
 
@@ -128,6 +141,27 @@ struct Matrix3x3 {
 
     float &operator()(int i, int j) { return m[i][j]; }
 
+    Matrix3x3 transposed() const {
+        Matrix3x3 t;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                t(i, j) = m[j][i];
+        return t;
+    }
+
+    Matrix3x3 inverse() const {
+        Matrix3x3 inv;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                inv(j, i) = m[(i + 1) % 3][(j + 1) % 3] * m[(i + 2) % 3][(j + 2) % 3] -
+                            m[(i + 1) % 3][(j + 2) % 3] * m[(i + 2) % 3][(j + 1) % 3];
+        float det = m[0][0] * inv(0, 0) + m[0][1] * inv(1, 0) + m[0][2] * inv(2, 0);
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                inv(i, j) /= det;
+        return inv;
+    }
+
     static Matrix3x3 scale(float k) {
         Matrix3x3 m;
         m(0, 0) = m(1, 1) = m(2, 2) = k;
@@ -168,19 +202,27 @@ struct Matrix3x3 {
 };
 
 
-inline bool read_png_file(const char *filename, Color *(&out), int &width, int &height);
+inline bool read_png_file(const char *filename, std::vector<uint8_t> &rgb, int &width, int &height);
 
 inline float randf() {
     return rand() / static_cast<float>(RAND_MAX);
 }
 
 
+// A ray with a cone around it, which tracks the footprint of a pixel for texture filtering:
+// the cone is cone_width wide at the origin and widens by cone_spread per unit distance.
 struct Ray {
     Vector3 origin;
     Vector3 direction;
+    float cone_width;
+    float cone_spread;
 
-    Ray(const Vector3 &origin, const Vector3 &direction_) :
-            origin(origin), direction(direction_.normalized()) {}
+    Ray(const Vector3 &origin, const Vector3 &direction_, float cone_width = 0, float cone_spread = 0) :
+            origin(origin), direction(direction_.normalized()), cone_width(cone_width), cone_spread(cone_spread) {}
+
+    float cone_width_at(float distance) const {
+        return cone_width + cone_spread * distance;
+    }
 };
 
 
@@ -261,14 +303,18 @@ struct AABB {
 };
 
 
+struct TextureRegistry;
+
 struct Texture {
-    virtual Color get_color(float u, float v) const = 0;
+    // footprint: width in uv units of the area to average over; 0 for a point sample
+    virtual Color get_color(float u, float v, float footprint = 0) const = 0;
 
     virtual ~Texture() {}
 
     virtual json to_json() const = 0;
 
-    static Texture *from_json(const json &in);
+    // with a registry, textures described by the same json are shared
+    static Texture *from_json(const json &in, TextureRegistry *registry = nullptr);
 };
 
 
@@ -285,7 +331,7 @@ struct GridTexture : public Texture {
 
     GridTexture(const json &in) : c0(in["c0"]), c1(in["c1"]) {}
 
-    Color get_color(float u, float v) const override {
+    Color get_color(float u, float v, float /*footprint*/ = 0) const override {
         int a1 = (static_cast<int>(u) & 1) == 0;
         int a2 = (static_cast<int>(v) & 1) == 0;
         if (u < 0) a1 ^= 1;
@@ -295,12 +341,24 @@ struct GridTexture : public Texture {
 };
 
 
+// MIP pyramid of 8-bit RGB texels. Every level is stored in TILE x TILE blocks, so that the four
+// texels of a bilinear fetch usually share a cache line, and the level is picked from the footprint
+// so that a fetch touches about one texel per pixel.
 struct PNGTexture : public Texture {
+    static constexpr int TILE = 4;
+
+    struct Level {
+        int width, height;
+        int num_tile_x;
+        size_t begin;   // into texels
+    };
+
     int width, height;
-    Color *img;
+    std::vector<Level> levels;
+    std::vector<uint8_t> texels;
     std::string filename;
 
-    PNGTexture(const char *filename_) : width(0), height(0), img(nullptr), filename(filename_) {
+    PNGTexture(const char *filename_) : width(0), height(0), filename(filename_) {
         init();
     }
 
@@ -309,19 +367,60 @@ struct PNGTexture : public Texture {
                 {"filename", filename}};
     }
 
-    PNGTexture(const json &in) : width(0), height(0), img(nullptr), filename(in["filename"].get<std::string>()) {
+    PNGTexture(const json &in) : width(0), height(0), filename(in["filename"].get<std::string>()) {
         init();
     }
 
     void init() {
-        bool success = read_png_file(filename.c_str(), img, width, height);
-        if (!success)
+        std::vector<uint8_t> rgb;
+        bool success = read_png_file(filename.c_str(), rgb, width, height);
+        if (!success) {
             fprintf(stderr, "failed to load texture file: %s\n", filename.c_str());
+            width = height = 0;
+            return;
+        }
+        // level sizes, halving (rounded down) down to 1x1
+        size_t size = 0;
+        for (int w = width, h = height;; w = std::max(1, w / 2), h = std::max(1, h / 2)) {
+            const int num_tile_x = (w + TILE - 1) / TILE, num_tile_y = (h + TILE - 1) / TILE;
+            levels.push_back({w, h, num_tile_x, size});
+            size += static_cast<size_t>(num_tile_x) * num_tile_y * TILE * TILE * 3;
+            if (w == 1 && h == 1) break;
+        }
+        texels.assign(size, 0);
+        for (int y = 0; y < height; ++y)
+            for (int x = 0; x < width; ++x)
+                memcpy(&texels[offset(levels[0], x, y)], &rgb[(static_cast<size_t>(y) * width + x) * 3], 3);
+        // box filter every level from the one above; odd rows and columns fold into the last texel
+        for (size_t i = 1; i < levels.size(); ++i) {
+            const Level &src = levels[i - 1], &dst = levels[i];
+            for (int y = 0; y < dst.height; ++y)
+                for (int x = 0; x < dst.width; ++x) {
+                    const int x0 = x * 2, x1 = std::min(src.width, x * 2 + (x + 1 == dst.width ? 3 : 2));
+                    const int y0 = y * 2, y1 = std::min(src.height, y * 2 + (y + 1 == dst.height ? 3 : 2));
+                    int sum[3] = {0, 0, 0}, n = 0;
+                    for (int sy = y0; sy < y1; ++sy)
+                        for (int sx = x0; sx < x1; ++sx, ++n)
+                            for (int c = 0; c < 3; ++c) sum[c] += texels[offset(src, sx, sy) + c];
+                    for (int c = 0; c < 3; ++c)
+                        texels[offset(dst, x, y) + c] = static_cast<uint8_t>((sum[c] + n / 2) / n);
+                }
+        }
+    }
+
+    size_t offset(const Level &level, int x, int y) const {
+        const size_t tile = static_cast<size_t>(y / TILE) * level.num_tile_x + x / TILE;
+        return level.begin + (tile * TILE * TILE + (y % TILE) * TILE + x % TILE) * 3;
     }
 
-    Color get_color(float u, float v) const override {
-        if (!img) return Color(1, 1, 1);
-        // fetch a bilinearly filtered texel
+    Color texel(const Level &level, int index) const {
+        index = std::min(level.width * level.height - 1, std::max(0, index));
+        const uint8_t *p = &texels[offset(level, index % level.width, index / level.width)];
+        return Color(p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f);
+    }
+
+    Color bilinear(const Level &level, float u, float v) const {
+        const int width = level.width, height = level.height;
         float fu = (u + 1000.0f) * width;
         float fv = (v + 1000.0f) * height;
         int u1 = ((int) fu) % width;
@@ -337,22 +436,125 @@ struct PNGTexture : public Texture {
         float w3 = (1 - fracu) * fracv;
         float w4 = fracu * fracv;
         // fetch four texels
-        Color c1 = img[std::min(width*height-1, std::max(0, u1 + v1 * width))];
-        Color c2 = img[std::min(width*height-1, std::max(0, u2 + v1 * width))];
-        Color c3 = img[std::min(width*height-1, std::max(0, u1 + v2 * width))];
-        Color c4 = img[std::min(width*height-1, std::max(0, u2 + v2 * width))];
+        Color c1 = texel(level, u1 + v1 * width);
+        Color c2 = texel(level, u2 + v1 * width);
+        Color c3 = texel(level, u1 + v2 * width);
+        Color c4 = texel(level, u2 + v2 * width);
         // scale and sum the four colors
         return c1 * w1 + c2 * w2 + c3 * w3 + c4 * w4;
     }
 
-    ~PNGTexture() {
-        free(img);
+    Color get_color(float u, float v, float footprint = 0) const override {
+        if (texels.empty()) return Color(1, 1, 1);
+        // trilinear between the two levels around the footprint measured in texels
+        const float lod = log2f(std::max(1.f, footprint * std::max(width, height)));
+        const int max_level = static_cast<int>(levels.size()) - 1;
+        const int l0 = std::min(static_cast<int>(lod), max_level);
+        const float frac = l0 == max_level ? 0 : lod - l0;
+        Color c = bilinear(levels[l0], u, v);
+        if (frac > 0) c = c * (1 - frac) + bilinear(levels[l0 + 1], u, v) * frac;
+        return c;
     }
 };
 
 
-inline Texture *Texture::from_json(const json &in) {
+// Scene-wide texture cache keyed by the texture json (for PNGTexture, its path), so that every
+// file is decoded once. Each acquire is matched by a release; the texture is freed with the last one.
+// Textures that were not acquired here are ignored by release.
+struct TextureRegistry {
+    TextureRegistry() {}
+
+    TextureRegistry(const TextureRegistry &) = delete;
+
+    TextureRegistry &operator=(const TextureRegistry &) = delete;
+
+    ~TextureRegistry() { clear(); }
+
+    // thread-safe; concurrent requests for the same texture wait for a single load. A failed load
+    // (nullptr, or an exception, which every waiter rethrows) is not cached, so the next request retries
+    Texture *acquire(const json &in) {
+        if (in.is_null()) return nullptr;
+        const std::string key = in.dump();
+        std::shared_future<Texture *> texture;
+        std::promise<Texture *> promise;
+        bool load = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = entries.find(key);
+            if (it == entries.end()) {
+                texture = promise.get_future().share();
+                entries.emplace(key, Entry{texture, 1});
+                load = true;
+            } else {
+                texture = it->second.texture;
+                ++it->second.refs;
+            }
+        }
+        if (load) {
+            Texture *loaded = nullptr;
+            try {
+                loaded = Texture::from_json(in);
+            } catch (...) {
+                forget(key);
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+            if (loaded) {
+                std::lock_guard<std::mutex> lock(mutex);
+                keys.emplace(loaded, key);
+            } else {
+                forget(key);
+            }
+            promise.set_value(loaded);
+        }
+        return texture.get();
+    }
+
+    void release(Texture *texture) {
+        if (!texture) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto key = keys.find(texture);
+        if (key == keys.end()) return;
+        auto it = entries.find(key->second);
+        if (--it->second.refs == 0) {
+            delete texture;
+            entries.erase(it);
+            keys.erase(key);
+        }
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto &key : keys) delete key.first;
+        entries.clear();
+        keys.clear();
+    }
+
+private:
+    struct Entry {
+        std::shared_future<Texture *> texture;
+        int refs;
+    };
+
+    mutable std::mutex mutex;
+    std::unordered_map<std::string, Entry> entries;
+    std::unordered_map<const Texture *, std::string> keys;   // of the loaded textures, for release
+
+    void forget(const std::string &key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        entries.erase(key);
+    }
+};
+
+
+inline Texture *Texture::from_json(const json &in, TextureRegistry *registry) {
     if (in.is_null()) return nullptr;
+    if (registry) return registry->acquire(in);
     const std::string t = in["type"];
     if (t == "GridTexture") return new GridTexture(in);
     else if (t == "PNGTexture") return new PNGTexture(in);
@@ -372,6 +574,27 @@ struct Material {
     Texture *texture;
     float texture_uscale;
     float texture_vscale;
+    uint32_t features = 0;  // Feature mask, see classify
+
+    // what the shading of a material has to do; every combination has its own shading kernel
+    enum Feature : uint32_t {
+        DIFFUSE = 1,
+        SPECULAR = 2,
+        REFLECT = 4,
+        DIFFUSE_REFLECT = 8,    // only together with REFLECT
+        REFRACT = 16,
+        TEXTURED = 32,
+        NUM_FEATURE_MASKS = 64
+    };
+
+    void classify() {
+        features = (k_diffuse > 0 ? static_cast<uint32_t>(DIFFUSE) : 0u) |
+                   (k_specular > 0 ? static_cast<uint32_t>(SPECULAR) : 0u) |
+                   (k_reflect > 0 ? static_cast<uint32_t>(REFLECT) : 0u) |
+                   (k_reflect > 0 && k_diffuse_reflect > 0 ? static_cast<uint32_t>(DIFFUSE_REFLECT) : 0u) |
+                   (k_refract > 0 ? static_cast<uint32_t>(REFRACT) : 0u) |
+                   (texture ? static_cast<uint32_t>(TEXTURED) : 0u);
+    }
 
     json to_json() const {
         json out = {{"color",             color.to_json()},
@@ -388,7 +611,7 @@ struct Material {
         return out;
     }
 
-    static Material from_json(const json &in) {
+    static Material from_json(const json &in, TextureRegistry *textures = nullptr) {
         return Material{
                 .color = Color(in["color"]),
                 .k_reflect = in["k_reflect"],
@@ -397,7 +620,7 @@ struct Material {
                 .k_specular = in["k_specular"],
                 .k_refract = in["k_refract"],
                 .k_refract_index = in["k_refract_index"],
-                .texture = Texture::from_json(in["texture"]),
+                .texture = Texture::from_json(in["texture"], textures),
                 .texture_uscale = in["texture_uscale"],
                 .texture_vscale = in["texture_vscale"]
         };
@@ -411,26 +634,29 @@ struct Primitive {
     };
     Type type;
     bool light;
+    uint32_t object_id;     // see Scene::object_id
     Material material;
     Vector3 *light_samples;
 
-    Primitive(Type type_) : type(type_), light(false), material(), light_samples(nullptr) {}
+    Primitive(Type type_) : type(type_), light(false), object_id(0), material(), light_samples(nullptr) {}
 
     virtual json to_json() const {
         return {{"light",    light},
                 {"material", material.to_json()}};
     }
 
-    Primitive(Type type_, const json &in) : type(type_), light(in["light"]),
-                                            material(Material::from_json(in["material"])), light_samples(nullptr) {}
+    Primitive(Type type_, const json &in, TextureRegistry *textures) :
+            type(type_), light(in["light"]), object_id(0), material(Material::from_json(in["material"], textures)),
+            light_samples(nullptr) {}
 
-    static Primitive *from_json(const json &in);
+    static Primitive *from_json(const json &in, TextureRegistry *textures = nullptr);
 
     virtual IntersectionResult intersect(const Ray &ray) const = 0;
 
     virtual Vector3 get_normal(const Vector3 &pos) const = 0;
 
-    virtual Color get_color(const Vector3 &pos) const { return material.color; }
+    // footprint: world space width of the ray cone at pos, for texture filtering
+    virtual Color get_color(const Vector3 &pos, float /*footprint*/ = 0) const { return material.color; }
 
     virtual float get_volume() const { return 0; }
 
@@ -467,7 +693,7 @@ struct Sphere : public Primitive {
         return out;
     }
 
-    Sphere(const json &in) : Primitive(SPHERE, in), center(in["center"]), radius(in["radius"]) {}
+    Sphere(const json &in, TextureRegistry *textures = nullptr) : Primitive(SPHERE, in, textures), center(in["center"]), radius(in["radius"]) {}
 
     IntersectionResult intersect(const Ray &ray) const override {
         Vector3 v = ray.origin - center;
@@ -508,7 +734,7 @@ struct Sphere : public Primitive {
         }
     }
 
-    Color get_color(const Vector3 &pos) const override {
+    Color get_color(const Vector3 &pos, float footprint = 0) const override {
         if (!material.texture) return material.color;
         Vector3 vn = Vector3(0, 1, 0);
         Vector3 ve = Vector3(1, 0, 0);
@@ -518,24 +744,23 @@ struct Sphere : public Primitive {
         float v = phi / static_cast<float>(M_PI);
         float theta = (acosf(ve.dot(vp) / sinf(phi))) * 2 / static_cast<float>(M_PI);
         float u = vc.dot(vp) >= 0 ? 1 - theta : theta;
-        Color texture_color = material.texture->get_color(u * material.texture_uscale, v * material.texture_vscale);
+        // u runs over 2 / pi and v over 1 / pi of the texture per unit of arc length along the sphere
+        float footprint_uv = footprint / radius *
+                             std::max(fabsf(material.texture_uscale) * 2, fabsf(material.texture_vscale)) / static_cast<float>(M_PI);
+        Color texture_color = material.texture->get_color(u * material.texture_uscale, v * material.texture_vscale,
+                                                          footprint_uv);
         return texture_color * material.color;
     }
 };
 
 
-struct Triangle;
-
 struct Vertex {
     Vector3 point;
     Vector3 normal;
-    std::vector<Triangle *> neighbor;
-
-    Vertex() : point(), normal(), neighbor() {}
 
-    Vertex(float x, float y, float z) : point(x, y, z), normal(), neighbor() {}
+    Vertex() : point(), normal() {}
 
-    void calc_normal();
+    Vertex(float x, float y, float z) : point(x, y, z), normal() {}
 };
 
 
@@ -593,9 +818,25 @@ struct Triangle : public Primitive {
                 .distance = dist};
     }
 
+    // barycentric coordinates of pos, which lies in the plane of the triangle
+    void calc_barycentric(const Vector3 &pos, float &u, float &v) const {
+        Vector3 v0v1 = v1->point - v0->point;
+        Vector3 v0v2 = v2->point - v0->point;
+        Vector3 v0p = pos - v0->point;
+        float d11 = v0v1.dot(v0v1), d12 = v0v1.dot(v0v2), d22 = v0v2.dot(v0v2);
+        float d1p = v0v1.dot(v0p), d2p = v0v2.dot(v0p);
+        float denom = d11 * d22 - d12 * d12;
+        if (denom == 0) {
+            u = v = 0;
+            return;
+        }
+        u = (d22 * d1p - d12 * d2p) / denom;
+        v = (d11 * d2p - d12 * d1p) / denom;
+    }
+
     Vector3 get_normal(const Vector3 &pos) const override {
-        float u, v, dist;
-        calc_intersect(Ray(Vector3(0, 0, 0), pos), u, v, dist);
+        float u, v;
+        calc_barycentric(pos, u, v);
         Vector3 n = v0->normal * (1 - u - v) + v1->normal * u + v2->normal * v;
         return n.normalized();
     }
@@ -607,13 +848,6 @@ struct Triangle : public Primitive {
     }
 };
 
-inline void Vertex::calc_normal() {
-    Vector3 n;
-    for (Triangle *t : neighbor) n += t->normal;
-    normal = n / neighbor.size();
-}
-
-
 struct Plane : public Primitive {
     Vector3 normal;
     float distance;
@@ -629,7 +863,7 @@ struct Plane : public Primitive {
         return out;
     }
 
-    Plane(const json &in) : Primitive(PLANE, in), normal(in["normal"]), distance(in["distance"]) {}
+    Plane(const json &in, TextureRegistry *textures = nullptr) : Primitive(PLANE, in, textures), normal(in["normal"]), distance(in["distance"]) {}
 
     IntersectionResult intersect(const Ray &ray) const override {
         float d = normal.dot(ray.direction);
@@ -644,13 +878,14 @@ struct Plane : public Primitive {
         return normal;
     }
 
-    Color get_color(const Vector3 &pos) const override {
+    Color get_color(const Vector3 &pos, float footprint = 0) const override {
         if (!material.texture) return material.color;
         Vector3 uaxis(normal.y, normal.z, -normal.x);
         Vector3 vaxis = uaxis.cross(normal);
         float u = pos.dot(uaxis) * material.texture_uscale;
         float v = pos.dot(vaxis) * material.texture_vscale;
-        Color texture_color = material.texture->get_color(u, v);
+        float footprint_uv = footprint * std::max(fabsf(material.texture_uscale), fabsf(material.texture_vscale));
+        Color texture_color = material.texture->get_color(u, v, footprint_uv);
         return texture_color * material.color;
     }
 };
@@ -668,7 +903,7 @@ struct Box : public Primitive {
         return out;
     }
 
-    Box(const json &in) : Primitive(BOX, in), aabb(in["aabb"]) {}
+    Box(const json &in, TextureRegistry *textures = nullptr) : Primitive(BOX, in, textures), aabb(in["aabb"]) {}
 
     IntersectionResult intersect(const Ray &ray) const override {
         return aabb.intersect(ray);
@@ -693,11 +928,11 @@ struct Box : public Primitive {
 };
 
 
-inline Primitive *Primitive::from_json(const json &in) {
+inline Primitive *Primitive::from_json(const json &in, TextureRegistry *textures) {
     const std::string t = in["type"];
-    if (t == "Sphere") return new Sphere(in);
-    else if (t == "Plane") return new Plane(in);
-    else if (t == "Box") return new Box(in);
+    if (t == "Sphere") return new Sphere(in, textures);
+    else if (t == "Plane") return new Plane(in, textures);
+    else if (t == "Box") return new Box(in, textures);
     fprintf(stderr, "unsupported primitive type: %s\n", t.c_str());
     return nullptr;
 }
@@ -730,107 +965,645 @@ struct FindNearestResult {
 // ref: https://blog.frogslayer.com/kd-trees-for-faster-ray-tracing-with-triangles/
 // ref: http://www.flipcode.com/archives/Raytracing_Topics_Techniques-Part_7_Kd-Trees_and_More_Speed.shtml
 // ref: https://github.com/ppwwyyxx/Ray-Tracing-Engine/blob/master/src/kdtree.cc
-struct KDTree {
-    struct Node {
-        AABB bbox;
-        Node *child[2];
-        std::vector<const Triangle *> triangles;
+// four triangles side by side for the SIMD version of Triangle::calc_intersect;
+// lanes past the last triangle are degenerate and never hit
+struct TrianglePack {
+    Vec3x4 v0, v0v1, v0v2;
+    uint32_t triangle[4];
+
+    TrianglePack() : triangle() {}
+
+    void set(int lane, uint32_t index, const Triangle &t) {
+        triangle[lane] = index;
+        set_lane(v0, lane, t.v0->point);
+        set_lane(v0v1, lane, t.v1->point - t.v0->point);
+        set_lane(v0v2, lane, t.v2->point - t.v0->point);
+    }
 
-        Node() : bbox(), child(), triangles() {}
+    // the same arithmetic as Triangle::calc_intersect, so that every lane gives the same result
+    mask4 intersect(const Vec3x4 &origin, const Vec3x4 &direction, float4 &dist) const {
+        Vec3x4 pvec = cross(direction, v0v2);
+        float4 det = dot(v0v1, pvec);
+        mask4 hit = abs(det) >= float4(EPS);
+        float4 inv_det = float4(1.f) / det;
 
-        ~Node() {
-            delete child[0];
-            delete child[1];
+        Vec3x4 tvec = origin - v0;
+        float4 u = dot(tvec, pvec) * inv_det;
+        hit = hit & (u >= float4(0.f)) & (u <= float4(1.f));
+
+        Vec3x4 qvec = cross(tvec, v0v1);
+        float4 v = dot(direction, qvec) * inv_det;
+        hit = hit & (v >= float4(0.f)) & (u + v <= float4(1.f));
+
+        dist = dot(v0v2, qvec) * inv_det;
+        return hit & (dist >= float4(0.f));
+    }
+
+private:
+    static void set_lane(Vec3x4 &out, int lane, const Vector3 &p) {
+        alignas(16) float x[4], y[4], z[4];
+        out.x.store(x), out.y.store(y), out.z.store(z);
+        x[lane] = p.x, y[lane] = p.y, z[lane] = p.z;
+        out = Vec3x4(float4::load(x), float4::load(y), float4::load(z));
+    }
+};
+
+
+// What a render spends its work on: the rays traced of every kind, the k-d tree nodes they visit,
+// the triangles they are tested against and the light samples shaded. Counters are kept per thread
+// and added up with flush() when a worker is done, like ShadowCache's; counting is off unless
+// enabled, as the k-d tree counters sit in the traversal loop. Whether a thread counts is its own
+// flag, which every render worker sets from its TraceConfig, so renders do not turn it on for
+// each other.
+struct RenderStats {
+    enum RayType { PRIMARY, SHADOW, REFLECTION, REFRACTION, DIFFUSE, NUM_RAY_TYPES };
+
+    static const char *name(RayType type) {
+        static const char *const names[NUM_RAY_TYPES] = {"primary", "shadow", "reflection", "refraction", "diffuse"};
+        return names[type];
+    }
+
+    struct Counters {
+        uint64_t rays[NUM_RAY_TYPES] = {};
+        uint64_t kd_nodes = 0;
+        uint64_t triangle_tests = 0;
+        uint64_t light_samples = 0;
+
+        uint64_t total_rays() const {
+            uint64_t n = 0;
+            for (uint64_t r : rays) n += r;
+            return n;
+        }
+
+        void add(const Counters &o) {
+            for (int i = 0; i < NUM_RAY_TYPES; ++i) rays[i] += o.rays[i];
+            kd_nodes += o.kd_nodes, triangle_tests += o.triangle_tests, light_samples += o.light_samples;
+        }
+
+        // one line per counter, rays with their rate over the given seconds of tracing
+        std::string report(double seconds) const {
+            std::string out;
+            char line[256];
+            const double rate = seconds > 0 ? 1e-6 / seconds : 0;
+            for (int i = 0; i < NUM_RAY_TYPES; ++i) {
+                snprintf(line, sizeof(line), "%21s rays    %llu (%.2f Mrays/s)\n", name(static_cast<RayType>(i)),
+                         static_cast<unsigned long long>(rays[i]), rays[i] * rate);
+                out += line;
+            }
+            const uint64_t total = total_rays();
+            const double per_ray = total ? 1. / total : 0;
+            snprintf(line, sizeof(line), "%26s    %llu (%.2f Mrays/s) in %.3fs\n", "all rays",
+                     static_cast<unsigned long long>(total), total * rate, seconds);
+            out += line;
+            snprintf(line, sizeof(line), "%26s    %llu (%.1f per ray)\n", "k-d nodes visited",
+                     static_cast<unsigned long long>(kd_nodes), kd_nodes * per_ray);
+            out += line;
+            snprintf(line, sizeof(line), "%26s    %llu (%.1f per ray)\n", "triangles tested",
+                     static_cast<unsigned long long>(triangle_tests), triangle_tests * per_ray);
+            out += line;
+            snprintf(line, sizeof(line), "%26s    %llu\n", "light samples shaded",
+                     static_cast<unsigned long long>(light_samples));
+            out += line;
+            return out;
         }
     };
 
-    Node *root;
+    // whether this thread counts
+    static bool &enabled() {
+        static thread_local bool on = false;
+        return on;
+    }
+
+    static void count_ray(RayType type, uint64_t n = 1) {
+        if (enabled()) get_local().rays[type] += n;
+    }
+
+    static void count_traversal(uint64_t kd_nodes, uint64_t triangle_tests) {
+        if (!enabled()) return;
+        Counters &local = get_local();
+        local.kd_nodes += kd_nodes, local.triangle_tests += triangle_tests;
+    }
+
+    static void count_light_samples(uint64_t n) {
+        if (enabled()) get_local().light_samples += n;
+    }
+
+    // this thread's counters since its last flush()
+    static const Counters &thread_counters() { return get_local(); }
+
+    // adds this thread's counters to the totals
+    static void flush() {
+        Counters &local = get_local();
+        Totals &totals = get_totals();
+        std::lock_guard<std::mutex> lock(totals.mutex);
+        totals.counters.add(local);
+        local = Counters();
+    }
+
+    static Counters totals() {
+        Totals &totals = get_totals();
+        std::lock_guard<std::mutex> lock(totals.mutex);
+        return totals.counters;
+    }
+
+    static void reset_totals() {
+        Totals &totals = get_totals();
+        std::lock_guard<std::mutex> lock(totals.mutex);
+        totals.counters = Counters();
+    }
+
+private:
+    struct Totals {
+        std::mutex mutex;
+        Counters counters;
+    };
+
+    static Counters &get_local() {
+        static thread_local Counters local;
+        return local;
+    }
+
+    static Totals &get_totals() {
+        static Totals totals;
+        return totals;
+    }
+};
+
+
+// Records every ray the renderer traces into a binary file, so that raytracer-replay can fire the
+// same rays at an intersection kernel without shading them. Every thread collects its rays and
+// appends them to the file a block at a time, so the order across threads is not kept.
+struct RayCapture {
+    static constexpr uint32_t VERSION = 1;
+
+    // the file is a Header followed by Records up to its end
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t sizeof_record;
+        uint64_t num_primitives, num_triangles;    // of the scene, to catch a replay against another one
+    };
+
+    struct Record {
+        float origin[3];
+        float direction[3];
+        float tmax;         // distance to the light sample for shadow rays, infinity otherwise
+        uint32_t type;      // RenderStats::RayType
+    };
+
+    static bool enabled() { return get_shared().file != nullptr; }
+
+    // starts recording; not while rendering
+    static bool open(const char *path, uint64_t num_primitives, uint64_t num_triangles) {
+        Shared &shared = get_shared();
+        close();
+        FILE *f = fopen(path, "wb");
+        if (!f) return false;
+        Header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "RTRAYS", 7);
+        h.version = VERSION;
+        h.sizeof_record = sizeof(Record);
+        h.num_primitives = num_primitives;
+        h.num_triangles = num_triangles;
+        if (fwrite(&h, sizeof(h), 1, f) != 1) {
+            fclose(f);
+            return false;
+        }
+        shared.file = f;
+        shared.num_records = 0;
+        shared.ok = true;
+        return true;
+    }
+
+    // stops recording; false if writing failed. The workers must have called flush() already
+    static bool close(uint64_t *num_records = nullptr) {
+        Shared &shared = get_shared();
+        if (!shared.file) return true;
+        flush();
+        bool ok = fclose(shared.file) == 0 && shared.ok;
+        shared.file = nullptr;
+        if (num_records) *num_records = shared.num_records;
+        return ok;
+    }
+
+    static void record(const Ray &ray, RenderStats::RayType type,
+                       float tmax = std::numeric_limits<float>::infinity()) {
+        if (!enabled()) return;
+        std::vector<Record> &local = get_local();
+        local.push_back({{ray.origin.x, ray.origin.y, ray.origin.z},
+                         {ray.direction.x, ray.direction.y, ray.direction.z},
+                         tmax, static_cast<uint32_t>(type)});
+        if (local.size() >= BLOCK_SIZE) flush();
+    }
+
+    // a shadow ray toward the light sample at target
+    static void record_shadow(const Ray &ray, const Vector3 &target) {
+        if (enabled()) record(ray, RenderStats::SHADOW, (target - ray.origin).length());
+    }
+
+    // appends this thread's rays to the file
+    static void flush() {
+        std::vector<Record> &local = get_local();
+        if (local.empty()) return;
+        Shared &shared = get_shared();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        if (shared.file) {
+            shared.ok = fwrite(local.data(), sizeof(Record), local.size(), shared.file) == local.size() && shared.ok;
+            shared.num_records += local.size();
+        }
+        local.clear();
+    }
+
+    // the records of a mapped capture file, or nullptr if it is not one
+    static const Record *records(const MappedFile &file, const Header *&header, size_t &num_records) {
+        if (file.size < sizeof(Header)) return nullptr;
+        header = reinterpret_cast<const Header *>(file.data);
+        if (memcmp(header->magic, "RTRAYS", 7) != 0 || header->version != VERSION ||
+            header->sizeof_record != sizeof(Record))
+            return nullptr;
+        num_records = (file.size - sizeof(Header)) / sizeof(Record);
+        return reinterpret_cast<const Record *>(file.data + sizeof(Header));
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 4096;
+
+    struct Shared {
+        std::mutex mutex;
+        FILE *file = nullptr;
+        uint64_t num_records = 0;
+        bool ok = true;
+    };
+
+    static std::vector<Record> &get_local() {
+        static thread_local std::vector<Record> local;
+        return local;
+    }
+
+    static Shared &get_shared() {
+        static Shared shared;
+        return shared;
+    }
+};
+
+
+struct KDTree {
+    // nodes are stored in one array in pre-order; leaves list their triangles in `indices`
+    struct Node {
+        AABB bbox;
+        int32_t child[2];     // -1 for leaves
+        uint32_t begin, end;  // leaf triangles: indices[begin, end)
+    };
+
+    const Triangle *triangles;
+    const Node *nodes;
+    const uint32_t *indices;
+    size_t num_nodes, num_indices;
     static constexpr int NUM_LEAF_OBJS = 8;
     static constexpr int NUM_MAX_DEPTH = 32;
 
-    KDTree() : root(nullptr) {}
+    KDTree() : triangles(nullptr), nodes(nullptr), indices(nullptr), num_nodes(0), num_indices(0) {}
+
+    KDTree(const KDTree &) = delete;
+
+    KDTree &operator=(const KDTree &) = delete;
+
+    void build(const Triangle *triangles_, size_t n) {
+        mapping.reset();
+        triangles = triangles_;
+        std::vector<uint32_t> all(n);
+        for (size_t i = 0; i < n; ++i) all[i] = static_cast<uint32_t>(i);
+        Subtree tree;
+        build(tree, all, 0);
+        node_storage.swap(tree.nodes);
+        index_storage.swap(tree.indices);
+        nodes = node_storage.data();
+        num_nodes = node_storage.size();
+        indices = index_storage.data();
+        num_indices = index_storage.size();
+        build_packs();
+    }
 
-    ~KDTree() { delete root; }
+    // use a tree that was built before and lives in `file`, without copying it
+    void use_mapped(const Triangle *triangles_, std::unique_ptr<MappedFile> file,
+                    const Node *nodes_, size_t num_nodes_, const uint32_t *indices_, size_t num_indices_) {
+        node_storage.clear();
+        index_storage.clear();
+        mapping = std::move(file);
+        triangles = triangles_;
+        nodes = nodes_;
+        num_nodes = num_nodes_;
+        indices = indices_;
+        num_indices = num_indices_;
+        build_packs();
+    }
 
-    void build(const std::vector<const Triangle *> &triangles) {
-        delete root;
-        root = build(triangles, 0);
+    // of the nodes, leaf indices and triangle packs, wherever they live
+    size_t memory_bytes() const {
+        return num_nodes * sizeof(Node) + num_indices * sizeof(uint32_t) + packs.size() * sizeof(TrianglePack) +
+               node_pack_begin.size() * sizeof(uint32_t);
     }
 
     FindNearestResult find_nearest(const Ray &ray) const {
-        return find_nearest(ray, root, std::numeric_limits<float>::max());
+        if (!num_nodes) return FindNearestResult();
+        uint32_t num_visited = 0, num_tested = 0;
+        FindNearestResult res = find_nearest(TraversalRay(ray), 0, std::numeric_limits<float>::max(),
+                                             num_visited, num_tested);
+        RenderStats::count_traversal(num_visited, num_tested);
+        return res;
+    }
+
+    // find_nearest of n <= 4 rays at once. The rays share one walk of the tree, in the order of the
+    // scalar one, with their boxes tested side by side; a ray takes part in a node or a leaf exactly
+    // when its own scalar walk would, so res[i] is find_nearest(*rays[i]) bit for bit.
+    void find_nearest4(const Ray *const *rays, int n, FindNearestResult *res) const {
+        for (int i = 0; i < n; ++i) res[i] = FindNearestResult();
+        if (!num_nodes || n <= 0) return;
+        alignas(16) float o[3][4] = {}, d[3][4] = {};
+        alignas(16) float best[4];
+        for (int i = 0; i < 4; ++i) {
+            const Ray &ray = *rays[std::min(i, n - 1)];
+            for (int k = 0; k < 3; ++k) o[k][i] = ray.origin.data[k], d[k][i] = ray.direction.data[k];
+            best[i] = std::numeric_limits<float>::max();
+        }
+        const TraversalPacket packet(o, d);
+        const TraversalRay lanes[4] = {TraversalRay(*rays[0]), TraversalRay(*rays[std::min(1, n - 1)]),
+                                       TraversalRay(*rays[std::min(2, n - 1)]), TraversalRay(*rays[std::min(3, n - 1)])};
+
+        // nodes still to visit, each with the rays whose walk reaches it
+        static thread_local std::vector<std::pair<int32_t, int>> stack;
+        stack.clear();
+        stack.emplace_back(0, (1 << n) - 1);
+        uint64_t num_visited = 0, num_tested = 0;
+        while (!stack.empty()) {
+            int32_t id = stack.back().first;
+            int entered = stack.back().second;
+            stack.pop_back();
+            for (;;) {
+                // a ray on its own takes the scalar walk of the subtree, which gives the same result
+                if (!(entered & (entered - 1))) {
+                    const int i = entered == 1 ? 0 : entered == 2 ? 1 : entered == 4 ? 2 : 3;
+                    uint32_t visited = 0, tested = 0;
+                    res[i].update(find_nearest(lanes[i], id, best[i], visited, tested));
+                    if (res[i].hit != IntersectionResult::MISS) best[i] = std::min(best[i], res[i].distance);
+                    num_visited += visited, num_tested += tested;
+                    break;
+                }
+                const Node &node = nodes[id];
+                num_visited += popcount4(entered);
+                const int active = intersect_box(node.bbox, packet, float4::load(best)) & entered;
+                if (!active) break;
+                if (node.child[0] >= 0) {
+                    stack.emplace_back(node.child[1], active);
+                    id = node.child[0], entered = active;
+                    continue;
+                }
+                const uint32_t begin = node_pack_begin[id], end = begin + (node.end - node.begin + 3) / 4;
+                for (int i = 0; i < n; ++i) {
+                    if (!(active >> i & 1)) continue;
+                    num_tested += node.end - node.begin;
+                    FindNearestResult leaf;
+                    intersect_leaf(lanes[i], begin, end, leaf);
+                    res[i].update(leaf);
+                    if (res[i].hit != IntersectionResult::MISS) best[i] = std::min(best[i], res[i].distance);
+                }
+                break;
+            }
+        }
+        RenderStats::count_traversal(num_visited, num_tested);
     }
 
 private:
+    std::vector<Node> node_storage;
+    std::vector<uint32_t> index_storage;
+    std::unique_ptr<MappedFile> mapping;
+    std::vector<TrianglePack> packs;        // the triangles of every leaf, four at a time
+    std::vector<uint32_t> node_pack_begin;  // first pack of every leaf
+
+    // the ray in the forms the SIMD box and triangle tests want
+    struct TraversalRay {
+        const Ray &ray;
+        float4 origin, inv_direction;
+        Vec3x4 origin4, direction4;
+
+        explicit TraversalRay(const Ray &ray_) :
+                ray(ray_), origin(float4::from_xyz(ray_.origin)),
+                inv_direction(float4(1.f) / float4::from_xyz(ray_.direction, 1.f)),
+                origin4(Vec3x4::broadcast(ray_.origin)), direction4(Vec3x4::broadcast(ray_.direction)) {}
+    };
+
+    // up to four rays side by side, for the box tests of find_nearest4
+    struct TraversalPacket {
+        Vec3x4 origin, inv_direction;
+
+        TraversalPacket(const float (&o)[3][4], const float (&d)[3][4]) :
+                origin(float4::load(o[0]), float4::load(o[1]), float4::load(o[2])),
+                inv_direction(float4(1.f) / float4::load(d[0]), float4(1.f) / float4::load(d[1]),
+                              float4(1.f) / float4::load(d[2])) {}
+    };
+
+    static int popcount4(int bits) { return (bits & 1) + (bits >> 1 & 1) + (bits >> 2 & 1) + (bits >> 3 & 1); }
+
+    void build_packs() {
+        packs.clear();
+        node_pack_begin.assign(num_nodes, 0);
+        for (size_t id = 0; id < num_nodes; ++id) {
+            const Node &node = nodes[id];
+            if (node.child[0] >= 0) continue;
+            node_pack_begin[id] = static_cast<uint32_t>(packs.size());
+            for (uint32_t i = node.begin; i < node.end; i += 4) {
+                packs.emplace_back();
+                for (uint32_t lane = 0; lane < 4 && i + lane < node.end; ++lane)
+                    packs.back().set(lane, indices[i + lane], triangles[indices[i + lane]]);
+            }
+        }
+    }
 
-    float get_split_plane_naive(const std::vector<const Triangle *> &triangles, int axis) const {
+    // slab test against the box grown by EPS; tnear is negative if the ray starts inside
+    static bool intersect_box(const AABB &box, const TraversalRay &r, float &tnear) {
+        float4 lo = float4::from_xyz(box.pos) - float4(EPS);
+        float4 hi = float4::from_xyz(box.pos + box.size) + float4(EPS);
+        float4 t1 = (lo - r.origin) * r.inv_direction, t2 = (hi - r.origin) * r.inv_direction;
+        tnear = hmax3(min(t1, t2));
+        float tfar = hmin3(max(t1, t2));
+        return tnear <= tfar && tfar >= 0;
+    }
+
+    // the same test for every ray of the packet, as lane bits; a ray whose box is farther than its
+    // opt_dist is off, like a scalar walk that returns there
+    static int intersect_box(const AABB &box, const TraversalPacket &p, float4 opt_dist) {
+        const Vector3 top = box.pos + box.size;
+        float4 tnear, tfar;
+        for (int k = 0; k < 3; ++k) {
+            const float4 o = k == 0 ? p.origin.x : k == 1 ? p.origin.y : p.origin.z;
+            const float4 inv = k == 0 ? p.inv_direction.x : k == 1 ? p.inv_direction.y : p.inv_direction.z;
+            const float4 t1 = (float4(box.pos.data[k] - EPS) - o) * inv, t2 = (float4(top.data[k] + EPS) - o) * inv;
+            tnear = k == 0 ? min(t1, t2) : std_max(tnear, min(t1, t2));
+            tfar = k == 0 ? max(t1, t2) : std_min(tfar, max(t1, t2));
+        }
+        return andnot((tnear <= tfar) & (tfar >= float4(0.f)), tnear > opt_dist).bits();
+    }
+
+    float get_split_plane_naive(const std::vector<uint32_t> &tris, int axis) const {
         float sum = 0;
-        for (const Triangle *t : triangles) {
-            sum += t->v0->point.data[axis];
-            sum += t->v1->point.data[axis];
-            sum += t->v2->point.data[axis];
+        for (uint32_t i : tris) {
+            const Triangle &t = triangles[i];
+            sum += t.v0->point.data[axis];
+            sum += t.v1->point.data[axis];
+            sum += t.v2->point.data[axis];
         }
-        return sum / (3 * triangles.size());
+        return sum / (3 * tris.size());
     }
 
-    Node *build(const std::vector<const Triangle *> &triangles, int depth) const {
-        Node *node = new Node();
-        for (const Triangle *t : triangles)
-            node->bbox.extend(t->get_bounding_box());
-        if (triangles.size() >= NUM_LEAF_OBJS && depth < NUM_MAX_DEPTH) {
+    struct Subtree {
+        std::vector<Node> nodes;
+        std::vector<uint32_t> indices;
+
+        // append `rhs` as it would have been built in place
+        void append(const Subtree &rhs) {
+            const int32_t node_base = static_cast<int32_t>(nodes.size());
+            const uint32_t index_base = static_cast<uint32_t>(indices.size());
+            for (Node node : rhs.nodes) {
+                if (node.child[0] >= 0) node.child[0] += node_base, node.child[1] += node_base;
+                else node.begin += index_base, node.end += index_base;
+                nodes.push_back(node);
+            }
+            indices.insert(indices.end(), rhs.indices.begin(), rhs.indices.end());
+        }
+    };
+
+    // the right subtrees of the top levels are built as tasks of the shared pool
+    static constexpr int NUM_PARALLEL_DEPTH = 3;
+
+    int32_t build(Subtree &tree, const std::vector<uint32_t> &tris, int depth) const {
+        const int32_t id = static_cast<int32_t>(tree.nodes.size());
+        tree.nodes.emplace_back();
+        Node node;
+        node.child[0] = node.child[1] = -1;
+        node.begin = node.end = 0;
+        for (uint32_t i : tris)
+            node.bbox.extend(triangles[i].get_bounding_box());
+        if (tris.size() >= NUM_LEAF_OBJS && depth < NUM_MAX_DEPTH) {
             int axis = depth % 3;
-            float plane = get_split_plane_naive(triangles, axis);
-            int common = 0;
-            std::vector<const Triangle *> lef, rig;
-            for (const Triangle *t : triangles) {
-                bool in_lef = t->v0->point.data[axis] <= plane || t->v1->point.data[axis] <= plane ||
-                              t->v2->point.data[axis] <= plane;
-                bool in_rig = t->v0->point.data[axis] >= plane || t->v1->point.data[axis] >= plane ||
-                              t->v2->point.data[axis] >= plane;
-                if (in_lef) lef.emplace_back(t);
-                if (in_rig) rig.emplace_back(t);
+            float plane = get_split_plane_naive(tris, axis);
+            size_t common = 0;
+            std::vector<uint32_t> lef, rig;
+            for (uint32_t i : tris) {
+                const Triangle &t = triangles[i];
+                bool in_lef = t.v0->point.data[axis] <= plane || t.v1->point.data[axis] <= plane ||
+                              t.v2->point.data[axis] <= plane;
+                bool in_rig = t.v0->point.data[axis] >= plane || t.v1->point.data[axis] >= plane ||
+                              t.v2->point.data[axis] >= plane;
+                if (in_lef) lef.emplace_back(i);
+                if (in_rig) rig.emplace_back(i);
                 if (in_lef && in_rig) ++common;
             }
-            if (common * 2 < triangles.size()) {
-                node->child[0] = build(lef, depth + 1);
-                node->child[1] = build(rig, depth + 1);
-                return node;
+            if (common * 2 < tris.size()) {
+                if (depth < NUM_PARALLEL_DEPTH && tris.size() >= 4096) {
+                    Subtree right;
+                    TaskPool::Group group;
+                    group.run([&] { build(right, rig, depth + 1); });
+                    node.child[0] = build(tree, lef, depth + 1);
+                    group.wait();
+                    node.child[1] = static_cast<int32_t>(tree.nodes.size());
+                    tree.append(right);
+                } else {
+                    node.child[0] = build(tree, lef, depth + 1);
+                    node.child[1] = build(tree, rig, depth + 1);
+                }
+                tree.nodes[id] = node;
+                return id;
             }
         }
 
         // if too few triangles, or too deep, or too many common triangles
-        node->triangles = triangles;
-        return node;
+        node.begin = static_cast<uint32_t>(tree.indices.size());
+        tree.indices.insert(tree.indices.end(), tris.begin(), tris.end());
+        node.end = static_cast<uint32_t>(tree.indices.size());
+        tree.nodes[id] = node;
+        return id;
     }
 
-    FindNearestResult find_nearest(const Ray &ray, Node *node, float opt_dist) const {
+    FindNearestResult find_nearest(const TraversalRay &r, int32_t id, float opt_dist, uint32_t &num_visited,
+                                   uint32_t &num_tested) const {
         FindNearestResult res;
-        IntersectionResult ibox = node->bbox.intersect(ray);
-        if (ibox.hit == IntersectionResult::MISS) return res;
-        if (ibox.distance > opt_dist) return res;
-        if (node->child[0] || node->child[1]) {
-            res.update(find_nearest(ray, node->child[0], opt_dist));
+        const Node &node = nodes[id];
+        ++num_visited;
+        float tnear;
+        if (!intersect_box(node.bbox, r, tnear)) return res;
+        if (tnear > opt_dist) return res;
+        if (node.child[0] >= 0) {
+            res.update(find_nearest(r, node.child[0], opt_dist, num_visited, num_tested));
             if (res.hit != IntersectionResult::MISS)
                 opt_dist = std::min(opt_dist, res.distance);
-            res.update(find_nearest(ray, node->child[1], opt_dist));
+            res.update(find_nearest(r, node.child[1], opt_dist, num_visited, num_tested));
         } else {
-            for (const Triangle *t : node->triangles)
-                res.update(t->intersect(ray), t);
+            num_tested += node.end - node.begin;
+            const uint32_t begin = node_pack_begin[id];
+            intersect_leaf(r, begin, begin + (node.end - node.begin + 3) / 4, res);
         }
         return res;
     }
+
+    // the triangle packs [begin, end) of a leaf
+    void intersect_leaf(const TraversalRay &r, uint32_t begin, uint32_t end, FindNearestResult &res) const {
+        for (uint32_t k = begin; k < end; ++k) {
+            float4 dist;
+            const int hits = packs[k].intersect(r.origin4, r.direction4, dist).bits();
+            if (!hits) continue;
+            alignas(16) float dists[4];
+            dist.store(dists);
+            // lanes in order, so that ties go to the same triangle as in the scalar loop
+            for (int lane = 0; lane < 4; ++lane) {
+                if (!(hits >> lane & 1)) continue;
+                const Triangle *t = &triangles[packs[k].triangle[lane]];
+                res.update(r.ray.direction.dot(t->normal) > 0 ? IntersectionResult::INSIDE : IntersectionResult::HIT,
+                           dists[lane], t);
+            }
+        }
+    }
+};
+
+
+// Body::load_obj keeps a binary copy of the mesh and its k-d tree next to the obj file. The arrays
+// are stored raw at 64-byte aligned offsets, so the tree is used straight from the mapped file.
+struct MeshCacheHeader {
+    static constexpr uint32_t VERSION = 1;
+    char magic[8];
+    uint32_t version;
+    uint32_t sizeof_vertex, sizeof_node, reserved;
+    uint64_t key;
+    uint64_t num_points, num_point_normals, num_triangles, num_nodes, num_indices;
+    uint64_t offset_points, offset_point_normals, offset_vertices, offset_corners, offset_nodes, offset_indices;
+    uint64_t file_size;
 };
 
+inline uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
 
 struct Body {
-    std::vector<Vector3> points;
-    std::vector<Vertex *> vertices;
-    std::vector<Triangle *> triangles;
+    std::vector<Vector3> points;        // untransformed position of every vertex
+    std::vector<Vector3> point_normals; // untransformed `vn` of every vertex, zero or empty to use face normals
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> triangles;    // refer to vertices
     KDTree kdtree;
     Material material;
     Matrix3x3 w = Matrix3x3::scale(1.0f);
     Vector3 b;
     std::string filename;
+    float load_seconds = 0;     // of reading the obj file or the mesh cache
+    float build_seconds = 0;    // of the last build(): vertex normals and the k-d tree
+
+    Body() {}
+
+    Body(const Body &) = delete;
+
+    Body &operator=(const Body &) = delete;
 
     json to_json() const {
         return {{"filename",  filename},
@@ -839,70 +1612,248 @@ struct Body {
                 {"offset",    b.to_json()}};
     }
 
-    static Body *from_json(const json &in) {
-        Body *body = load_obj(in["filename"].get<std::string>().c_str());
+    static Body *from_json(const json &in, TextureRegistry *textures = nullptr, bool use_cache = true) {
+        Body *body = load_obj(in["filename"].get<std::string>().c_str(), Matrix3x3(in["transform"]), Vector3(in["offset"]),
+                              use_cache);
+        if (body) body->set_material(Material::from_json(in["material"], textures));
+        return body;
+    }
+
+    // load the mesh transformed by (w, b), from the cache file if it is up to date; without
+    // use_cache, the obj file is parsed and the tree built, and no cache file is read or written
+    static Body *load_obj(const char *path, const Matrix3x3 &w = Matrix3x3::scale(1.0f), const Vector3 &b = Vector3(),
+                          bool use_cache = true) {
+        const auto start = std::chrono::high_resolution_clock::now();
+        auto seconds_since_start = [&] {
+            return static_cast<float>((std::chrono::high_resolution_clock::now() - start).count() / 1e9);
+        };
+        const std::string cache_path = std::string(path) + ".rtcache";
+        const uint64_t key = use_cache ? cache_key(path, w, b) : 0;
+        Body *body = load_cache(cache_path.c_str(), key);
         if (body) {
-            body->set_material(Material::from_json(in["material"]));
-            body->w = Matrix3x3(in["transform"]);
-            body->b = Vector3(in["offset"]);
-            body->build();
+            body->filename = path;
+            body->w = w;
+            body->b = b;
+            body->load_seconds = seconds_since_start();
+            return body;
         }
+
+        ObjMesh mesh;
+        if (!mesh.load(path)) return nullptr;
+        body = new Body;
+        body->filename = path;
+        body->w = w;
+        body->b = b;
+        body->set_mesh(mesh);
+        body->load_seconds = seconds_since_start();
+        body->build();
+        if (key && !body->save_cache(cache_path.c_str(), key))
+            fprintf(stderr, "failed to write mesh cache: %s\n", cache_path.c_str());
         return body;
     }
 
-    static Body *load_obj(const char *path) {
-        FILE *f = fopen(path, "r");
-        if (!f) {
-            fprintf(stderr, "failed to open obj file: %s\n", path);
+    static uint64_t cache_key(const char *path, const Matrix3x3 &w, const Vector3 &b) {
+        struct stat st;
+        if (stat(path, &st) != 0) return 0;
+        // nanoseconds, so that an edit within the same second as the cached one is seen
+#ifdef __APPLE__
+        const timespec &mtime = st.st_mtimespec;
+#else
+        const timespec &mtime = st.st_mtim;
+#endif
+        const int64_t file_info[] = {static_cast<int64_t>(st.st_size), static_cast<int64_t>(mtime.tv_sec),
+                                     static_cast<int64_t>(mtime.tv_nsec)};
+        const int build_info[] = {static_cast<int>(MeshCacheHeader::VERSION), KDTree::NUM_LEAF_OBJS, KDTree::NUM_MAX_DEPTH};
+        uint64_t key = fnv1a(file_info, sizeof(file_info));
+        key = fnv1a(build_info, sizeof(build_info), key);
+        key = fnv1a(w.m, sizeof(w.m), key);
+        return fnv1a(b.data, sizeof(b.data), key);
+    }
+
+    static Body *load_cache(const char *cache_path, uint64_t key) {
+        std::unique_ptr<MappedFile> file(new MappedFile);
+        if (!key || !file->open(cache_path) || file->size < sizeof(MeshCacheHeader)) return nullptr;
+        const MeshCacheHeader &h = *reinterpret_cast<const MeshCacheHeader *>(file->data);
+        if (memcmp(h.magic, "RTCACHE", 8) != 0 || h.version != MeshCacheHeader::VERSION || h.key != key ||
+            h.sizeof_vertex != sizeof(Vertex) || h.sizeof_node != sizeof(KDTree::Node) || h.file_size != file->size)
+            return nullptr;
+
+        // the file may be corrupt or written by something else: every section must lie within it, and
+        // every index must be in range, or the obj file is parsed again
+        auto in_file = [&](uint64_t offset, uint64_t count, size_t element_size) {
+            return offset >= sizeof(MeshCacheHeader) && offset % 64 == 0 && offset <= h.file_size &&
+                   count <= (h.file_size - offset) / element_size;
+        };
+        if (!in_file(h.offset_points, h.num_points, sizeof(Vector3)) ||
+            !in_file(h.offset_point_normals, h.num_point_normals, sizeof(Vector3)) ||
+            !in_file(h.offset_vertices, h.num_points, sizeof(Vertex)) ||
+            !in_file(h.offset_corners, h.num_triangles, 3 * sizeof(uint32_t)) ||
+            !in_file(h.offset_nodes, h.num_nodes, sizeof(KDTree::Node)) ||
+            !in_file(h.offset_indices, h.num_indices, sizeof(uint32_t)) ||
+            (h.num_point_normals != 0 && h.num_point_normals != h.num_points) ||
+            h.num_points > std::numeric_limits<uint32_t>::max() || h.num_nodes > std::numeric_limits<int32_t>::max())
             return nullptr;
+        const char *base = file->data;
+        const Vector3 *points = reinterpret_cast<const Vector3 *>(base + h.offset_points);
+        const Vector3 *point_normals = reinterpret_cast<const Vector3 *>(base + h.offset_point_normals);
+        const Vertex *vertices = reinterpret_cast<const Vertex *>(base + h.offset_vertices);
+        const uint32_t *corners = reinterpret_cast<const uint32_t *>(base + h.offset_corners);
+        const KDTree::Node *nodes = reinterpret_cast<const KDTree::Node *>(base + h.offset_nodes);
+        const uint32_t *indices = reinterpret_cast<const uint32_t *>(base + h.offset_indices);
+        for (uint64_t i = 0; i < h.num_triangles * 3; ++i)
+            if (corners[i] >= h.num_points) return nullptr;
+        for (uint64_t i = 0; i < h.num_indices; ++i)
+            if (indices[i] >= h.num_triangles) return nullptr;
+        // nodes are in pre-order, so children come after their parent and traversal cannot loop
+        for (uint64_t id = 0; id < h.num_nodes; ++id) {
+            const KDTree::Node &node = nodes[id];
+            const bool ok = node.child[0] >= 0
+                    ? node.child[0] > static_cast<int64_t>(id) && static_cast<uint64_t>(node.child[0]) < h.num_nodes &&
+                      node.child[1] > static_cast<int64_t>(id) && static_cast<uint64_t>(node.child[1]) < h.num_nodes
+                    : node.begin <= node.end && node.end <= h.num_indices;
+            if (!ok) return nullptr;
         }
 
         Body *body = new Body;
-        body->filename = path;
-        char buf[100];
-        while (fscanf(f, " %s", buf) != EOF) {
-            if (strcmp(buf, "v") == 0) {
-                float x, y, z;
-                fscanf(f, "%f%f%f", &x, &y, &z);
-                body->points.emplace_back(x, y, z);
-                body->vertices.emplace_back(new Vertex(x, y, z));
-            } else if (strcmp(buf, "f") == 0) {
-                Vertex *v[3];
-                for (int i = 0, idx; i < 3; ++i) {
-                    fscanf(f, " %s", buf);
-                    sscanf(buf, "%d", &idx);
-                    v[i] = body->vertices[idx - 1];
+        body->points.assign(points, points + h.num_points);
+        body->point_normals.assign(point_normals, point_normals + h.num_point_normals);
+        body->vertices.assign(vertices, vertices + h.num_points);
+        body->triangles.reserve(h.num_triangles);
+        Vertex *v = body->vertices.data();
+        for (size_t i = 0; i < h.num_triangles; ++i)
+            body->triangles.emplace_back(v + corners[i * 3], v + corners[i * 3 + 1], v + corners[i * 3 + 2]);
+        body->kdtree.use_mapped(body->triangles.data(), std::move(file), nodes, h.num_nodes, indices, h.num_indices);
+        return body;
+    }
+
+    bool save_cache(const char *cache_path, uint64_t key) const {
+        std::vector<uint32_t> corners;
+        corners.reserve(triangles.size() * 3);
+        const Vertex *base = vertices.data();
+        for (const Triangle &t : triangles)
+            for (const Vertex *v : {t.v0, t.v1, t.v2})
+                corners.push_back(static_cast<uint32_t>(v - base));
+
+        MeshCacheHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "RTCACHE", 8);
+        h.version = MeshCacheHeader::VERSION;
+        h.sizeof_vertex = sizeof(Vertex);
+        h.sizeof_node = sizeof(KDTree::Node);
+        h.key = key;
+        h.num_points = points.size();
+        h.num_point_normals = point_normals.size();
+        h.num_triangles = triangles.size();
+        h.num_nodes = kdtree.num_nodes;
+        h.num_indices = kdtree.num_indices;
+        const struct {
+            const void *data;
+            size_t size;
+            uint64_t *offset;
+        } sections[] = {{points.data(),        points.size() * sizeof(Vector3),         &h.offset_points},
+                        {point_normals.data(), point_normals.size() * sizeof(Vector3),  &h.offset_point_normals},
+                        {vertices.data(),      vertices.size() * sizeof(Vertex),        &h.offset_vertices},
+                        {corners.data(),       corners.size() * sizeof(uint32_t),       &h.offset_corners},
+                        {kdtree.nodes,         kdtree.num_nodes * sizeof(KDTree::Node), &h.offset_nodes},
+                        {kdtree.indices,       kdtree.num_indices * sizeof(uint32_t),   &h.offset_indices}};
+        uint64_t offset = sizeof(h);
+        for (const auto &section : sections) {
+            offset = (offset + 63) / 64 * 64;
+            *section.offset = offset;
+            offset += section.size;
+        }
+        h.file_size = offset;
+
+        // write to a temporary file first, so that concurrent renders never see a partial cache
+        const std::string tmp_path = std::string(cache_path) + "." + std::to_string(getpid()) + "." +
+                                     std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        FILE *f = fopen(tmp_path.c_str(), "wb");
+        if (!f) return false;
+        bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+        static const char zeros[64] = {};
+        uint64_t written = sizeof(h);
+        for (const auto &section : sections) {
+            ok = ok && fwrite(zeros, 1, *section.offset - written, f) == *section.offset - written;
+            ok = ok && (!section.size || fwrite(section.data, section.size, 1, f) == 1);
+            written = *section.offset + section.size;
+        }
+        ok = fclose(f) == 0 && ok;
+        ok = ok && rename(tmp_path.c_str(), cache_path) == 0;
+        if (!ok) remove(tmp_path.c_str());
+        return ok;
+    }
+
+    // one vertex per obj position, split where the corners of a position use different `vn`
+    void set_mesh(const ObjMesh &mesh) {
+        const size_t num_position = mesh.positions.size() / 3;
+        const size_t num_corner = mesh.corners.size() / 2;
+        std::vector<int> index(num_corner);
+        points.resize(num_position);
+        for (size_t i = 0; i < num_position; ++i)
+            points[i] = Vector3(mesh.positions[i * 3], mesh.positions[i * 3 + 1], mesh.positions[i * 3 + 2]);
+        point_normals.clear();
+        if (mesh.normals.empty()) {
+            for (size_t c = 0; c < num_corner; ++c)
+                index[c] = mesh.corners[c * 2];
+        } else {
+            point_normals.resize(num_position);
+            std::vector<int> first_normal(num_position, -2);
+            std::unordered_map<uint64_t, int> split;
+            for (size_t c = 0; c < num_corner; ++c) {
+                const int v = mesh.corners[c * 2], vn = mesh.corners[c * 2 + 1];
+                if (first_normal[v] == -2 || first_normal[v] == vn) {
+                    first_normal[v] = vn;
+                    index[c] = v;
+                } else {
+                    const uint64_t key = static_cast<uint64_t>(v) << 32 | static_cast<uint32_t>(vn);
+                    auto it = split.find(key);
+                    if (it == split.end()) {
+                        it = split.emplace(key, static_cast<int>(points.size())).first;
+                        const Vector3 point = points[v];
+                        points.push_back(point);
+                        point_normals.emplace_back();
+                    }
+                    index[c] = it->second;
                 }
-                Triangle *triangle = new Triangle(v[0], v[1], v[2]);
-                for (int i = 0; i < 3; ++i)
-                    v[i]->neighbor.emplace_back(triangle);
-                body->triangles.emplace_back(triangle);
-            } else if (buf[0] == '#'
-                       || strcmp(buf, "mtllib") == 0
-                       || strcmp(buf, "vn") == 0
-                       || strcmp(buf, "vt") == 0
-                       || strcmp(buf, "s") == 0
-                       || strcmp(buf, "g") == 0
-                       || strcmp(buf, "o") == 0
-                       || strcmp(buf, "usemtl") == 0) {
-                // not supported
-                while (fgetc(f) != '\n');
-            } else {
-                // unexpected
-                delete body;
-                fprintf(stderr, "failed to parse obj file: %s\n", path);
-                return nullptr;
+                if (vn >= 0)
+                    point_normals[index[c]] = Vector3(mesh.normals[vn * 3], mesh.normals[vn * 3 + 1],
+                                                      mesh.normals[vn * 3 + 2]);
             }
         }
-        body->build();
 
-        fclose(f);
+        vertices.assign(points.size(), Vertex());
+        triangles.clear();
+        triangles.reserve(num_corner / 3);
+        for (size_t c = 0; c < num_corner; c += 3)
+            triangles.emplace_back(&vertices[index[c]], &vertices[index[c + 1]], &vertices[index[c + 2]]);
+    }
+
+    // copy the mesh without reading the obj file again, e.g. to pose it in the background
+    Body *clone() const {
+        Body *body = new Body;
+        body->points = points;
+        body->point_normals = point_normals;
+        body->vertices = vertices;
+        body->material = material;
+        body->w = w;
+        body->b = b;
+        body->filename = filename;
+        body->triangles.reserve(triangles.size());
+        const Vertex *base = vertices.data();
+        Vertex *clone_base = body->vertices.data();
+        for (const Triangle &t : triangles) {
+            body->triangles.emplace_back(clone_base + (t.v0 - base), clone_base + (t.v1 - base),
+                                         clone_base + (t.v2 - base));
+            body->triangles.back().material = t.material;
+        }
+        body->build();
         return body;
     }
 
     void set_material(const Material &m) {
         material = m;
-        for (Triangle *t : triangles) t->material = m;
+        material.classify();
+        for (Triangle &t : triangles) t.material = material;
     }
 
     void scale(float k) {
@@ -923,19 +1874,460 @@ struct Body {
     }
 
     void build() {
-        for (size_t i = 0; i < points.size(); ++i)
-            vertices[i]->point = w * points[i] + b;
-        for (Triangle *t : triangles)
-            t->set_vertices(t->v0, t->v1, t->v2);
-        for (Vertex *v : vertices)
-            v->calc_normal();
-        std::vector<const Triangle *> v(triangles.begin(), triangles.end());
-        kdtree.build(v);
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (size_t i = 0; i < points.size(); ++i) {
+            vertices[i].point = w * points[i] + b;
+            vertices[i].normal = Vector3();
+        }
+
+        // vertex normal: average of the adjacent face normals, unless given by the obj file
+        std::vector<int> degree(vertices.size());
+        const Vertex *base = vertices.data();
+        for (Triangle &t : triangles) {
+            t.set_vertices(t.v0, t.v1, t.v2);
+            for (Vertex *v : {t.v0, t.v1, t.v2}) {
+                v->normal += t.normal;
+                ++degree[v - base];
+            }
+        }
+        const Matrix3x3 normal_w = w.inverse().transposed();
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            if (!point_normals.empty() && point_normals[i].length2() > 0)
+                vertices[i].normal = (normal_w * point_normals[i]).normalized();
+            else
+                vertices[i].normal /= degree[i];
+        }
+
+        kdtree.build(triangles.data(), triangles.size());
+        build_seconds = static_cast<float>((std::chrono::high_resolution_clock::now() - start).count() / 1e9);
+    }
+};
+
+
+// pinhole camera looking from origin through a screen rectangle centered at target
+struct Camera {
+    Vector3 origin = Vector3(0, 0, -6);
+    Vector3 target = Vector3(0, 0, -2);
+    Vector3 up = Vector3(0, 1, 0);
+    float width = 8, height = 6;
+
+    Camera() {}
+
+    json to_json() const {
+        return {{"origin", origin.to_json()},
+                {"target", target.to_json()},
+                {"up",     up.to_json()},
+                {"width",  width},
+                {"height", height}};
+    }
+
+    Camera(const json &in) : origin(in["origin"]), target(in["target"]), up(in["up"]),
+                             width(in["width"]), height(in["height"]) {}
+
+    // the screen point of pixel (x, y) is corner + dx * x + dy * y
+    void get_screen(int image_width, int image_height, Vector3 &corner, Vector3 &dx, Vector3 &dy) const {
+        Vector3 forward = (target - origin).normalized();
+        Vector3 right = up.cross(forward).normalized();
+        Vector3 upward = forward.cross(right);
+        corner = target - right * (width / 2) + upward * (height / 2);
+        dx = right * (width / image_width);
+        dy = -upward * (height / image_height);
+    }
+
+    // primary rays through the pixels of an image_width x image_height picture
+    struct Screen {
+        Vector3 origin, corner, dx, dy;
+        float pixel_spread;     // angle covered by one pixel, for the ray cones
+
+        Ray ray(int x, int y) const { return Ray(origin, corner + dx * x + dy * y - origin, 0, pixel_spread); }
+    };
+
+    Screen get_screen(int image_width, int image_height) const {
+        Screen screen;
+        screen.origin = origin;
+        get_screen(image_width, image_height, screen.corner, screen.dx, screen.dy);
+        screen.pixel_spread = screen.dx.length() / (target - origin).length();
+        return screen;
+    }
+};
+
+
+// keyframed camera and body transforms; keys are linearly interpolated and clamped at both ends
+struct Animation {
+    struct CameraKey {
+        float frame;
+        Vector3 origin;
+        Vector3 target;
+    };
+
+    struct TransformKey {
+        float frame;
+        Vector3 rotate; // degree, applied in x-y-z order like Body::rotate_xyz
+        float scale;
+        Vector3 offset;
+    };
+
+    struct BodyTrack {
+        int body; // index into Scene::bodies
+        std::vector<TransformKey> keys;
+    };
+
+    int num_frames = 0;
+    std::vector<CameraKey> camera_keys;
+    std::vector<BodyTrack> body_tracks;
+
+    json to_json() const {
+        json out_camera = json::array();
+        for (const CameraKey &k : camera_keys)
+            out_camera.push_back({{"frame",  k.frame},
+                                  {"origin", k.origin.to_json()},
+                                  {"target", k.target.to_json()}});
+        json out_body = json::array();
+        for (const BodyTrack &track : body_tracks) {
+            json keys = json::array();
+            for (const TransformKey &k : track.keys)
+                keys.push_back({{"frame",  k.frame},
+                                {"rotate", k.rotate.to_json()},
+                                {"scale",  k.scale},
+                                {"offset", k.offset.to_json()}});
+            out_body.push_back({{"body", track.body},
+                                {"keys", keys}});
+        }
+        return {{"frames", num_frames},
+                {"camera", out_camera},
+                {"body",   out_body}};
+    }
+
+    void from_json(const json &in) {
+        num_frames = in["frames"];
+        camera_keys.clear();
+        body_tracks.clear();
+        if (in.count("camera"))
+            for (const auto &k : in["camera"])
+                camera_keys.push_back({k["frame"], Vector3(k["origin"]), Vector3(k["target"])});
+        if (in.count("body")) {
+            for (const auto &t : in["body"]) {
+                BodyTrack track;
+                track.body = t["body"];
+                for (const auto &k : t["keys"]) {
+                    TransformKey key = {k["frame"], Vector3(0, 0, 0), 1.f, Vector3(0, 0, 0)};
+                    if (k.count("rotate")) key.rotate = Vector3(k["rotate"]);
+                    if (k.count("scale")) key.scale = k["scale"];
+                    if (k.count("offset")) key.offset = Vector3(k["offset"]);
+                    track.keys.push_back(key);
+                }
+                body_tracks.push_back(track);
+            }
+        }
     }
 
-    ~Body() {
-        for (Vertex *v : vertices) delete v;
-        for (Triangle *t : triangles) delete t;
+    Camera camera_at(const Camera &base, float frame) const {
+        Camera camera = base;
+        if (camera_keys.empty()) return camera;
+        const CameraKey *k0, *k1;
+        float t = find_keys(camera_keys, frame, k0, k1);
+        camera.origin = k0->origin * (1 - t) + k1->origin * t;
+        camera.target = k0->target * (1 - t) + k1->target * t;
+        return camera;
+    }
+
+    // pose `body` relative to its rest transform (w0, b0); rebuilds the k-d tree
+    static void pose(Body *body, const Matrix3x3 &w0, const Vector3 &b0, const BodyTrack &track, float frame) {
+        if (track.keys.empty()) return;
+        const TransformKey *k0, *k1;
+        float t = find_keys(track.keys, frame, k0, k1);
+        Vector3 rotate = (k0->rotate * (1 - t) + k1->rotate * t) / 180.0f * static_cast<float>(M_PI);
+        float scale = k0->scale * (1 - t) + k1->scale * t;
+        Matrix3x3 w = Matrix3x3::scale(scale) * w0;
+        w = Matrix3x3::rotate_x(rotate.x) * w;
+        w = Matrix3x3::rotate_y(rotate.y) * w;
+        w = Matrix3x3::rotate_z(rotate.z) * w;
+        body->w = w;
+        body->b = b0 + k0->offset * (1 - t) + k1->offset * t;
+        body->build();
+    }
+
+private:
+    template <typename Key>
+    static float find_keys(const std::vector<Key> &keys, float frame, const Key *&k0, const Key *&k1) {
+        size_t i = 0;
+        while (i + 1 < keys.size() && keys[i + 1].frame <= frame) ++i;
+        k0 = &keys[i];
+        k1 = i + 1 < keys.size() ? &keys[i + 1] : k0;
+        if (k1->frame <= k0->frame) return 0;
+        return std::max(0.f, std::min(1.f, (frame - k0->frame) / (k1->frame - k0->frame)));
+    }
+};
+
+
+// Scene::primitives by type in 4-wide SoA packs, so that a ray is tested against four spheres,
+// planes or boxes at a time without virtual calls. Each kernel does the arithmetic of the type's
+// intersect, and ties go to the primitive that comes first in Scene::primitives, so the nearest
+// hit is exactly the one the virtual loop finds. Primitives of other types are kept as they are.
+struct AnalyticPrimitives {
+    struct SpherePack {
+        Vec3x4 center;
+        float4 radius2;
+        uint32_t index[4];  // into Scene::primitives
+        int count;
+    };
+
+    struct PlanePack {
+        Vec3x4 normal;
+        float4 distance;
+        uint32_t index[4];
+        int count;
+    };
+
+    struct BoxPack {
+        Vec3x4 lo, hi;
+        uint32_t index[4];
+        int count;
+    };
+
+    std::vector<SpherePack> spheres;
+    std::vector<PlanePack> planes;
+    std::vector<BoxPack> boxes;
+    std::vector<uint32_t> others;
+    const std::vector<Primitive *> *primitives = nullptr;
+
+    void build(const std::vector<Primitive *> &primitives_) {
+        primitives = &primitives_;
+        spheres.clear(), planes.clear(), boxes.clear(), others.clear();
+        alignas(16) float buf[7][4];
+        for (int type : {Primitive::SPHERE, Primitive::PLANE, Primitive::BOX}) {
+            std::vector<uint32_t> ids;
+            for (uint32_t i = 0; i < primitives_.size(); ++i)
+                if (primitives_[i]->type == type) ids.push_back(i);
+            for (size_t k = 0; k < ids.size(); k += 4) {
+                const int count = static_cast<int>(std::min<size_t>(4, ids.size() - k));
+                for (auto &row : buf) std::fill(row, row + 4, 0.f);
+                uint32_t index[4] = {0, 0, 0, 0};
+                for (int lane = 0; lane < count; ++lane) {
+                    index[lane] = ids[k + lane];
+                    const Primitive *p = primitives_[index[lane]];
+                    Vector3 a, b;
+                    float f = 0;
+                    if (type == Primitive::SPHERE) {
+                        const Sphere *sphere = static_cast<const Sphere *>(p);
+                        a = sphere->center, f = sphere->radius * sphere->radius;
+                    } else if (type == Primitive::PLANE) {
+                        const Plane *plane = static_cast<const Plane *>(p);
+                        a = plane->normal, f = plane->distance;
+                    } else {
+                        const Box *box = static_cast<const Box *>(p);
+                        a = box->aabb.pos, b = box->aabb.pos + box->aabb.size;
+                    }
+                    for (int c = 0; c < 3; ++c) buf[c][lane] = a.data[c], buf[3 + c][lane] = b.data[c];
+                    buf[6][lane] = f;
+                }
+                const Vec3x4 a(float4::load(buf[0]), float4::load(buf[1]), float4::load(buf[2]));
+                const Vec3x4 b(float4::load(buf[3]), float4::load(buf[4]), float4::load(buf[5]));
+                const float4 f = float4::load(buf[6]);
+                if (type == Primitive::SPHERE) {
+                    spheres.push_back({a, f, {}, count});
+                    std::copy(index, index + 4, spheres.back().index);
+                } else if (type == Primitive::PLANE) {
+                    planes.push_back({a, f, {}, count});
+                    std::copy(index, index + 4, planes.back().index);
+                } else {
+                    boxes.push_back({a, b, {}, count});
+                    std::copy(index, index + 4, boxes.back().index);
+                }
+            }
+        }
+        for (uint32_t i = 0; i < primitives_.size(); ++i) {
+            const Primitive::Type type = primitives_[i]->type;
+            if (type != Primitive::SPHERE && type != Primitive::PLANE && type != Primitive::BOX) others.push_back(i);
+        }
+    }
+
+    void find_nearest(const Ray &ray, FindNearestResult &res) const {
+        uint32_t res_index = 0;
+        auto update = [&](IntersectionResult::HitType hit, float distance, uint32_t index) {
+            if (res.hit == IntersectionResult::MISS || distance < res.distance ||
+                (distance == res.distance && index < res_index)) {
+                res.hit = hit, res.distance = distance, res.primitive = (*primitives)[index];
+                res_index = index;
+            }
+        };
+        const Vec3x4 o = Vec3x4::broadcast(ray.origin), d = Vec3x4::broadcast(ray.direction);
+        alignas(16) float dist[4];
+
+        for (const SpherePack &pack : spheres) {
+            Vec3x4 v = o - pack.center;
+            float4 b = -dot(v, d);
+            float4 det = b * b - dot(v, v) + pack.radius2;
+            mask4 hit = det > float4(0.f);
+            if (!(hit.bits() & ((1 << pack.count) - 1))) continue;
+            det = sqrt(max(det, float4(0.f)));
+            float4 i1 = b - det, i2 = b + det;
+            hit = hit & (i2 > float4(0.f));
+            mask4 inside = i1 < float4(0.f);
+            select(inside, i2, i1).store(dist);
+            const int hits = hit.bits(), insides = inside.bits();
+            for (int lane = 0; lane < pack.count; ++lane)
+                if (hits >> lane & 1)
+                    update(insides >> lane & 1 ? IntersectionResult::INSIDE : IntersectionResult::HIT, dist[lane],
+                           pack.index[lane]);
+        }
+
+        for (const PlanePack &pack : planes) {
+            float4 dn = dot(pack.normal, d);
+            float4 t = (dot(pack.normal, o) + pack.distance) / -dn;
+            const int hits = (((dn < float4(0.f)) | (dn > float4(0.f))) & (t > float4(0.f))).bits();
+            if (!hits) continue;
+            t.store(dist);
+            for (int lane = 0; lane < pack.count; ++lane)
+                if (hits >> lane & 1) update(IntersectionResult::HIT, dist[lane], pack.index[lane]);
+        }
+
+        // AABB::intersect: the nearest of the six face planes whose crossing lies in the box grown by EPS
+        const float *po = ray.origin.data, *pd = ray.direction.data;
+        for (const BoxPack &pack : boxes) {
+            float4 best(0.f);
+            mask4 found;
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!pd[axis]) continue;
+                for (int side = 0; side < 2; ++side) {
+                    const Vec3x4 &plane = side ? pack.hi : pack.lo;
+                    float4 t = ((axis == 0 ? plane.x : axis == 1 ? plane.y : plane.z) - float4(po[axis])) / float4(pd[axis]);
+                    Vec3x4 ip = o + t * d;
+                    // faces at distance 0 are skipped like in AABB::intersect
+                    mask4 in = ((t < float4(0.f)) | (t > float4(0.f))) &
+                               (ip.x > pack.lo.x - float4(EPS)) & (ip.x < pack.hi.x + float4(EPS)) &
+                               (ip.y > pack.lo.y - float4(EPS)) & (ip.y < pack.hi.y + float4(EPS)) &
+                               (ip.z > pack.lo.z - float4(EPS)) & (ip.z < pack.hi.z + float4(EPS));
+                    // the first face found, or a nearer one
+                    mask4 take = andnot(in, found) | (in & (best > t));
+                    best = select(take, t, best);
+                    found = found | in;
+                }
+            }
+            const int hits = found.bits();
+            if (!hits) continue;
+            best.store(dist);
+            for (int lane = 0; lane < pack.count; ++lane)
+                if (hits >> lane & 1) update(IntersectionResult::HIT, dist[lane], pack.index[lane]);
+        }
+
+        for (uint32_t index : others) {
+            const Primitive *p = (*primitives)[index];
+            IntersectionResult r = p->intersect(ray);
+            if (r.hit != IntersectionResult::MISS) update(r.hit, r.distance, index);
+        }
+    }
+};
+
+
+// Bounding volume hierarchy over Scene::lights, for shading with a few lights picked per point
+// instead of all of them. Every node keeps the bounds and the summed power of its lights. A light
+// is picked by walking down from the root and taking each child with probability proportional
+// to its importance at the shading point: its power times the largest cosine that any point of
+// its bounds makes with the normal (or with the mirrored view direction, for the highlight).
+// Lights do not fall off with distance here, so distance only enters through the cone the bounds
+// subtend. Children that cannot light the point have importance zero, which keeps shading with
+// weight 1 / pdf unbiased.
+struct LightTree {
+    struct Node {
+        Vector3 lo, hi;
+        float power;
+        int child;                  // the first of two children, the second follows it; -1 for a leaf
+        const Primitive *light;     // of a leaf
+    };
+
+    std::vector<Node> nodes;
+
+    void build(const std::vector<Primitive *> &lights) {
+        nodes.clear();
+        std::vector<Node> leaves;
+        for (const Primitive *light : lights) {
+            // shading takes sphere lights as points at their center and box lights as samples in the box
+            Node leaf = {Vector3(), Vector3(), light->material.color.r + light->material.color.g + light->material.color.b,
+                         -1, light};
+            if (light->type == Primitive::SPHERE) {
+                leaf.lo = leaf.hi = static_cast<const Sphere *>(light)->center;
+            } else if (light->type == Primitive::BOX) {
+                const AABB &aabb = static_cast<const Box *>(light)->aabb;
+                leaf.lo = aabb.pos, leaf.hi = aabb.pos + aabb.size;
+            } else {
+                continue;
+            }
+            if (leaf.power > 0) leaves.push_back(leaf);
+        }
+        if (leaves.empty()) return;
+        nodes.reserve(leaves.size() * 2 - 1);
+        nodes.emplace_back();
+        build(0, leaves.begin(), leaves.end());
+    }
+
+    // p: shading point, N: its normal, R: the view direction mirrored at N if the highlight counts;
+    // u in [0, 1]. Returns nullptr if no light can reach p.
+    const Primitive *sample(const Vector3 &p, const Vector3 &N, const Vector3 *R, float u, float &pdf) const {
+        if (nodes.empty() || importance(nodes[0], p, N, R) <= 0) return nullptr;
+        pdf = 1;
+        int i = 0;
+        while (nodes[i].child >= 0) {
+            u = std::min(u, 0.99999994f);
+            const int child = nodes[i].child;
+            const float a = importance(nodes[child], p, N, R), b = importance(nodes[child + 1], p, N, R);
+            if (a + b <= 0) return nullptr;
+            const float pa = a / (a + b);
+            if (u < pa) {
+                u /= pa, pdf *= pa, i = child;
+            } else {
+                u = (u - pa) / (1 - pa), pdf *= 1 - pa, i = child + 1;
+            }
+        }
+        return nodes[i].light;
+    }
+
+private:
+    typedef std::vector<Node>::iterator Iter;
+
+    // fills nodes[index] with the subtree of [begin, end); median split along the widest axis of the centers
+    void build(int index, Iter begin, Iter end) {
+        if (end - begin == 1) {
+            nodes[index] = *begin;
+            return;
+        }
+        Vector3 lo = begin->lo, hi = begin->hi, clo = begin->lo + begin->hi, chi = clo;
+        float power = 0;
+        for (Iter it = begin; it != end; ++it) {
+            lo = min(lo, it->lo), hi = max(hi, it->hi);
+            clo = min(clo, it->lo + it->hi), chi = max(chi, it->lo + it->hi);
+            power += it->power;
+        }
+        const Vector3 extent = chi - clo;
+        const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        Iter mid = begin + (end - begin) / 2;
+        std::nth_element(begin, mid, end, [axis](const Node &a, const Node &b) {
+            return a.lo.data[axis] + a.hi.data[axis] < b.lo.data[axis] + b.hi.data[axis];
+        });
+        const int child = static_cast<int>(nodes.size());
+        nodes[index] = {lo, hi, power, child, nullptr};
+        nodes.emplace_back(), nodes.emplace_back();
+        build(child, begin, mid);
+        build(child + 1, mid, end);
+    }
+
+    static float importance(const Node &node, const Vector3 &p, const Vector3 &N, const Vector3 *R) {
+        // the bounding sphere of the node, grown a little so that rounding never rules out a light
+        const Vector3 d = (node.lo + node.hi) * 0.5f - p;
+        const float radius = (node.hi - node.lo).length() * 0.5f + EPS;
+        const float dist2 = d.length2();
+        if (dist2 <= radius * radius) return node.power;
+        const float dist = sqrtf(dist2), sin_a = radius / dist, cos_a = sqrtf(1 - sin_a * sin_a);
+        // cosine of the angle between axis and the nearest direction into the cone
+        auto max_cos = [&](const Vector3 &axis) {
+            const float cos_t = axis.dot(d) / dist;
+            if (cos_t >= cos_a) return 1.f;
+            const float sin_t = sqrtf(std::max(0.f, 1 - cos_t * cos_t));
+            return std::max(0.f, cos_t * cos_a + sin_t * sin_a);
+        };
+        float cos_bound = max_cos(N);
+        if (R) cos_bound = std::max(cos_bound, max_cos(*R));
+        return node.power * cos_bound;
     }
 };
 
@@ -944,24 +2336,106 @@ struct Scene {
     std::vector<Primitive *> lights;
     std::vector<Primitive *> primitives;
     std::vector<Body *> bodies;
+    Camera camera;
+    Animation animation;
+    TextureRegistry textures;   // of the primitives and bodies loaded from json
+    AnalyticPrimitives analytic;    // packed copy of primitives, valid after prepare()
+    LightTree light_tree;   // of lights, valid after prepare()
+    uint64_t version = 0;   // new with every prepare(), for caches that hold on to primitives
+    bool analytic_ready = false;
 
     json to_json() const {
         json out_primitive = json::array();
         json out_body = json::array();
         for (auto p : primitives) out_primitive.push_back(p->to_json());
         for (auto b : bodies) out_body.push_back(b->to_json());
-        return {{"primitive", out_primitive},
-                {"body",      out_body}};
+        json out = {{"primitive", out_primitive},
+                    {"body",      out_body},
+                    {"camera",    camera.to_json()}};
+        if (animation.num_frames > 0) out["animation"] = animation.to_json();
+        return out;
     }
 
-    void from_json(const json &in) {
-        for (const auto &p : in["primitive"])
-            add(Primitive::from_json(p));
-        for (const auto &b : in["body"])
-            add(Body::from_json(b));
+    // without use_mesh_cache, the bodies are loaded from their obj files, see Body::load_obj
+    void from_json(const json &in, bool use_mesh_cache = true) {
+        // every primitive (with its texture) and every body loads as a task of the shared pool;
+        // the results are added in file order
+        const json &in_primitive = in["primitive"], &in_body = in["body"];
+        std::vector<Primitive *> loaded_primitives(in_primitive.size(), nullptr);
+        std::vector<Body *> loaded_bodies(in_body.size(), nullptr);
+        TaskPool::Group group;
+        for (size_t i = 0; i < in_primitive.size(); ++i)
+            group.run([&, i] { loaded_primitives[i] = Primitive::from_json(in_primitive[i], &textures); });
+        for (size_t i = 0; i < in_body.size(); ++i)
+            group.run([&, i] { loaded_bodies[i] = Body::from_json(in_body[i], &textures, use_mesh_cache); });
+        group.wait();
+        for (Primitive *p : loaded_primitives)
+            if (p) add(p);
+        for (Body *b : loaded_bodies)
+            if (b) add(b);
+        if (in.count("camera")) camera = Camera(in["camera"]);
+        if (in.count("animation")) animation.from_json(in["animation"]);
+    }
+
+    FindNearestResult find_nearest(const Ray &ray) const {
+        FindNearestResult res = find_nearest_primitive(ray);
+        // use kdtree:
+        for (Body *body : bodies)
+            res.update(body->kdtree.find_nearest(ray));
+//        // use brute force:
+//        for (const Primitive *pr : primitives)
+//            res.update(pr->intersect(ray), pr);
+//        for (Body *body : bodies)
+//            for (const Triangle *t : body->triangles)
+//                res.update(t->intersect(ray), t);
+        return res;
+    }
+
+    // find_nearest of n <= 4 rays, which go through the k-d trees as one packet
+    void find_nearest4(const Ray *const *rays, int n, FindNearestResult *res) const {
+        for (int i = 0; i < n; ++i) res[i] = find_nearest_primitive(*rays[i]);
+        FindNearestResult body_res[4];
+        for (Body *body : bodies) {
+            body->kdtree.find_nearest4(rays, n, body_res);
+            for (int i = 0; i < n; ++i) res[i].update(body_res[i]);
+        }
+    }
+
+    FindNearestResult find_nearest_primitive(const Ray &ray) const {
+        FindNearestResult res;
+        if (analytic_ready) {
+            analytic.find_nearest(ray, res);
+        } else {
+            for (const Primitive *pr : primitives)
+                res.update(pr->intersect(ray), pr);
+        }
+        return res;
+    }
+
+    // 1 + the index of the primitive, or 1 + primitives.size() + the index of the body a triangle
+    // belongs to; 0 for none. Assigned by prepare()
+    uint32_t object_id(const Primitive *p) const { return p ? p->object_id : 0; }
+
+    // Called before rendering: edits of primitives (e.g. from the GUI) take effect once their
+    // materials are classified and the packed copies and the light tree are built again. Bodies
+    // classify their materials in Body::set_material. Every primitive and triangle gets its object_id.
+    void prepare() {
+        for (size_t i = 0; i < primitives.size(); ++i) {
+            primitives[i]->material.classify();
+            primitives[i]->object_id = static_cast<uint32_t>(i + 1);
+        }
+        for (size_t i = 0; i < bodies.size(); ++i)
+            for (Triangle &t : bodies[i]->triangles) t.object_id = static_cast<uint32_t>(primitives.size() + i + 1);
+        analytic.build(primitives);
+        light_tree.build(lights);
+        analytic_ready = true;
+        static std::atomic<uint64_t> next_version(0);
+        version = ++next_version;
     }
 
     void add(Primitive *p) {
+        p->material.classify();
+        analytic_ready = false;
         primitives.emplace_back(p);
         if (p->light) lights.emplace_back(p);
     }
@@ -970,12 +2444,35 @@ struct Scene {
         bodies.emplace_back(b);
     }
 
+    void remove(Primitive *p) {
+        primitives.erase(std::remove(primitives.begin(), primitives.end(), p), primitives.end());
+        lights.erase(std::remove(lights.begin(), lights.end(), p), lights.end());
+        analytic_ready = false;
+        textures.release(p->material.texture);
+        delete p;
+    }
+
+    void remove(Body *b) {
+        bodies.erase(std::remove(bodies.begin(), bodies.end(), b), bodies.end());
+        textures.release(b->material.texture);
+        delete b;
+    }
+
     void clear() {
-        for (Primitive *p : primitives) delete p;
-        for (Body *b : bodies) delete b;
+        for (Primitive *p : primitives) {
+            textures.release(p->material.texture);
+            delete p;
+        }
+        for (Body *b : bodies) {
+            textures.release(b->material.texture);
+            delete b;
+        }
         primitives.clear();
         lights.clear();
+        analytic_ready = false;
         bodies.clear();
+        camera = Camera();
+        animation = Animation();
     }
 
     ~Scene() {
@@ -984,31 +2481,218 @@ struct Scene {
 };
 
 
+// For every light sample, the primitive that last blocked a shadow ray of this thread toward it.
+// Shadow rays from neighbouring points toward one sample tend to be blocked by the same primitive,
+// so it is tested first: if it is hit before the light, the light is not the nearest hit whatever
+// else lies on the ray, and the scene query is skipped. The answers are the same as without the
+// cache. Entries are dropped when the scene is prepared again, as primitives may have been deleted.
+struct ShadowCache {
+    struct Stats {
+        uint64_t num_ray = 0;       // shadow rays
+        uint64_t num_blocked = 0;   // of which did not reach their light
+        uint64_t num_test = 0;      // with a cached occluder to test
+        uint64_t num_hit = 0;       // answered by the cached occluder, without a scene query
+
+        Stats &operator+=(const Stats &s) {
+            num_ray += s.num_ray, num_blocked += s.num_blocked, num_test += s.num_test, num_hit += s.num_hit;
+            return *this;
+        }
+    };
+
+    // true if the nearest hit of ray, which goes toward the given sample of light, is light
+    static bool visible(const Scene &scene, const Ray &ray, const Primitive *light, int sample) {
+        Local &local = get_local();
+        if (local.version != scene.version) {
+            local.occluders.clear();
+            local.last_light = nullptr;
+            local.version = scene.version;
+        }
+        ++local.stats.num_ray;
+        if (light != local.last_light) {
+            local.last_light = light;
+            local.last_occluders = &local.occluders[light];
+        }
+        std::vector<const Primitive *> &occluders = *local.last_occluders;
+        if (static_cast<size_t>(sample) >= occluders.size()) occluders.resize(sample + 1, nullptr);
+        const Primitive *&occluder = occluders[sample];
+        if (occluder) {
+            ++local.stats.num_test;
+            IntersectionResult o = occluder->intersect(ray);
+            if (o.hit != IntersectionResult::MISS) {
+                IntersectionResult target = light->intersect(ray);
+                if (target.hit == IntersectionResult::MISS || o.distance < target.distance) {
+                    ++local.stats.num_hit;
+                    ++local.stats.num_blocked;
+                    return false;
+                }
+            }
+        }
+        // a visible light is likely visible from the next point as well, which need not test anything
+        const Primitive *nearest = scene.find_nearest(ray).primitive;
+        occluder = nearest == light ? nullptr : nearest;
+        if (nearest == light) return true;
+        ++local.stats.num_blocked;
+        return false;
+    }
+
+    // adds the counts of this thread to the totals; called by every worker when it is done
+    static void flush() {
+        Local &local = get_local();
+        std::lock_guard<std::mutex> lock(get_totals().mutex);
+        get_totals().stats += local.stats;
+        local.stats = Stats();
+    }
+
+    static Stats totals() {
+        std::lock_guard<std::mutex> lock(get_totals().mutex);
+        return get_totals().stats;
+    }
+
+    static void reset_totals() {
+        std::lock_guard<std::mutex> lock(get_totals().mutex);
+        get_totals().stats = Stats();
+    }
+
+private:
+    struct Local {
+        uint64_t version = 0;
+        std::unordered_map<const Primitive *, std::vector<const Primitive *>> occluders;    // by light, by sample
+        const Primitive *last_light = nullptr;      // consecutive rays mostly go to the same light
+        std::vector<const Primitive *> *last_occluders = nullptr;
+        Stats stats;
+    };
+
+    struct Totals {
+        std::mutex mutex;
+        Stats stats;
+    };
+
+    static Local &get_local() {
+        static thread_local Local local;
+        return local;
+    }
+
+    static Totals &get_totals() {
+        static Totals totals;
+        return totals;
+    }
+};
+
+
+// Primary hits of the pixels of a render window, kept from one render to the next. A render of the
+// same window of a frame of the same size, seen from the same camera, shades these hits again
+// instead of tracing its primary rays, which is all that changes when only materials and light
+// colors are edited. Nothing here notices edits of the geometry: whoever makes them has to call
+// invalidate() before the next render.
+struct PrimaryHitCache {
+    int x0 = 0, y0 = 0, width = 0, height = 0;     // the window, in pixels of the frame
+    int frame_width = 0, frame_height = 0;
+    Camera::Screen screen;
+    bool valid = false;     // every hit is filled in
+    std::vector<FindNearestResult> hits;
+
+    bool matches(int x0_, int y0_, int width_, int height_, int frame_width_, int frame_height_,
+                 const Camera::Screen &screen_) const {
+        return valid && same_window(x0_, y0_, width_, height_, frame_width_, frame_height_, screen_);
+    }
+
+    // of the same window, valid or being filled in
+    bool same_window(int x0_, int y0_, int width_, int height_, int frame_width_, int frame_height_,
+                     const Camera::Screen &screen_) const {
+        return x0 == x0_ && y0 == y0_ && width == width_ && height == height_ &&
+               frame_width == frame_width_ && frame_height == frame_height_ &&
+               memcmp(&screen, &screen_, sizeof(screen)) == 0;
+    }
+
+    // to be filled in by the next render
+    void reset(int x0_, int y0_, int width_, int height_, int frame_width_, int frame_height_,
+               const Camera::Screen &screen_) {
+        x0 = x0_, y0 = y0_, width = width_, height = height_;
+        frame_width = frame_width_, frame_height = frame_height_;
+        screen = screen_;
+        valid = false;
+        hits.resize(static_cast<size_t>(width) * height);
+    }
+
+    void invalidate() { valid = false; }
+
+    // pixel (x, y) of the frame
+    FindNearestResult &at(int x, int y) { return hits[static_cast<size_t>(y - y0) * width + (x - x0)]; }
+};
+
+
+struct TraceConfig {
+    enum CostMetric { COST_NONE, COST_TIME, COST_NODES, COST_RAYS };
+
+    float num_light_sample_per_unit = 1.0f;
+    int num_trace_depth = 3;
+    int num_diffuse_reflect_sample = 32;
+    int num_worker = 4;
+    bool wavefront = false;     // trace tiles with the WavefrontIntegrator instead of recursive ray_trace
+    bool sort_secondary = false;    // wavefront only: trace bounce rays in direction octant / origin Morton order
+    int num_light_pick = 0;     // lights picked per shading point from Scene::light_tree, 0 to shade with every light
+    float irradiance_cache_error = 0;   // recursive only: interpolate diffuse reflection within this error, 0 to sample every hit
+    bool shadow_cache = true;   // test the last occluder toward a light first, see ShadowCache
+    int denoise_passes = 0;     // edge-aware a-trous passes over the finished image, 0 for none
+    bool primary_hit_cache = false;     // keep the primary hits for the next render, see PrimaryHitCache
+    bool collect_stats = false;     // count rays, traversal steps and light samples, see RenderStats
+    CostMetric cost_metric = COST_NONE;     // per pixel work to measure, see cost_counter
+    // Progressive rendering: only the pixels of the frame at multiples of pixel_step are traced, and
+    // with skip_coarser_pixels not those at multiples of 2 * pixel_step, which the pass before traced.
+    // Passes from a coarse step down to 1 thus trace every pixel once, and fill the primary hit cache
+    // together. The other pixels of out are left as they are.
+    int pixel_step = 1;
+    bool skip_coarser_pixels = false;
+
+    TraceConfig() {}
+
+    // whether the render counts its work in RenderStats, for the stats or the cost metric
+    bool counts_work() const {
+        return collect_stats || cost_metric == COST_NODES || cost_metric == COST_RAYS;
+    }
+
+    bool traces_pixel(int x, int y) const {
+        if (x % pixel_step || y % pixel_step) return false;
+        return !skip_coarser_pixels || x % (2 * pixel_step) || y % (2 * pixel_step);
+    }
+
+    static bool parse_cost_metric(const char *name, CostMetric &metric) {
+        static const char *const names[] = {"none", "time", "nodes", "rays"};
+        for (int i = 0; i < 4; ++i) {
+            if (strcmp(name, names[i]) == 0) {
+                metric = static_cast<CostMetric>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+// The running count of config.cost_metric on this thread: steady clock nanoseconds, k-d tree nodes
+// visited or rays traced (the latter two counted in RenderStats, see TraceConfig::counts_work). The cost of a pixel is the
+// difference across the work done for it.
+inline uint64_t cost_counter(const TraceConfig &config) {
+    switch (config.cost_metric) {
+        case TraceConfig::COST_TIME:
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count());
+        case TraceConfig::COST_NODES:
+            return RenderStats::thread_counters().kd_nodes;
+        case TraceConfig::COST_RAYS:
+            return RenderStats::thread_counters().total_rays();
+        default:
+            return 0;
+    }
+}
+
+
 inline void color_save_to_array(uint8_t *out, const Color &color) {
     out[0] = static_cast<uint8_t>(std::min(color.r * 255.f, 255.f));
     out[1] = static_cast<uint8_t>(std::min(color.g * 255.f, 255.f));
     out[2] = static_cast<uint8_t>(std::min(color.b * 255.f, 255.f));
 }
 
-inline void save_ppm(const char *path, uint8_t *data, int width, int height) {
-    FILE *f = fopen(path, "w");
-    if (!f) {
-        fprintf(stderr, "failed to save ppm file to: %s\n", path);
-        return;
-    }
-    fprintf(f, "P3\n");
-    fprintf(f, "%d %d\n", width, height);
-    fprintf(f, "255\n");
-    for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-            int i = (y * width + x) * 3;
-            fprintf(f, "%u\t%u\t%u\t", data[i], data[i + 1], data[i + 2]);
-        }
-        fprintf(f, "\n");
-    }
-    fclose(f);
-}
-
 inline Vector3 uniform_sample_hemisphere() {
     // cos(theta) = u1 = y
     // cos^2(theta) + sin^2(theta) = 1 -> sin(theta) = srtf(1 - cos^2(theta))
@@ -1022,95 +2706,40 @@ inline Vector3 uniform_sample_hemisphere() {
 }
 
 // ref: https://gist.github.com/niw/5963798
-inline bool read_png_file(const char *filename, Color *(&out), int &width, int &height) {
-    // read png
+inline bool read_png_file(const char *filename, std::vector<uint8_t> &rgb, int &width, int &height) {
     FILE *fp = fopen(filename, "rb");
     if (!fp) return false;
     png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) return false;
-    png_infop info = png_create_info_struct(png);
-    if (!info) return false;
-    if (setjmp(png_jmpbuf(png))) return false;
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    std::vector<png_bytep> row_pointers;
+    if (!info || setjmp(png_jmpbuf(png))) {
+        if (png) png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+        fclose(fp);
+        return false;
+    }
     png_init_io(png, fp);
     png_read_info(png, info);
     width = static_cast<int>(png_get_image_width(png, info));
     height = static_cast<int>(png_get_image_height(png, info));
     png_byte color_type = png_get_color_type(png, info);
     png_byte bit_depth = png_get_bit_depth(png, info);
+    // everything is read as 8-bit RGB
     if (bit_depth == 16) png_set_strip_16(png);
     if (color_type == PNG_COLOR_TYPE_PALETTE) png_set_palette_to_rgb(png);
     if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) png_set_expand_gray_1_2_4_to_8(png);
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) png_set_tRNS_to_alpha(png);
-    if (color_type == PNG_COLOR_TYPE_RGB ||
-        color_type == PNG_COLOR_TYPE_GRAY ||
-        color_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    if (color_type & PNG_COLOR_MASK_ALPHA) png_set_strip_alpha(png);
     if (color_type == PNG_COLOR_TYPE_GRAY ||
         color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
         png_set_gray_to_rgb(png);
     png_read_update_info(png, info);
-    png_bytep *row_pointers = (png_bytep *) malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; y++)
-        row_pointers[y] = (png_byte *) malloc(png_get_rowbytes(png, info));
-    png_read_image(png, row_pointers);
-
-    // save to Color array
-    out = static_cast<Color *>(malloc(sizeof(Color) * width * height));
-    for (int y = 0, k = 0; y < height; ++y) {
-        png_byte *row = row_pointers[y];
-        for (int x = 0; x < width; ++x, ++k) {
-            png_byte *rgba = &row[x * 4];
-            out[k].r = rgba[0] / 255.0f;
-            out[k].g = rgba[1] / 255.0f;
-            out[k].b = rgba[2] / 255.0f;
-        }
-    }
 
-    // clean up
-    for (int y = 0; y < height; ++y)
-        free(row_pointers[y]);
-    free(row_pointers);
-    fclose(fp);
-    return true;
-}
-
-// ref: https://gist.github.com/niw/5963798
-inline bool _save_png(const char *path, uint8_t *data, int width, int height) {
-    FILE *fp = fopen(path, "w");
-    if (!fp) return false;
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) return false;
-    png_infop info = png_create_info_struct(png);
-    if (!info) return false;
-    if (setjmp(png_jmpbuf(png))) return false;
-    png_init_io(png, fp);
-    png_set_IHDR(png, info, (png_uint_32) width, (png_uint_32) height, 8,
-                 PNG_COLOR_TYPE_RGBA,
-                 PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT,
-                 PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-    png_bytep *row_pointers = (png_bytep *) malloc(sizeof(png_bytep) * height);
-    for (int y = 0; y < height; y++) {
-        row_pointers[y] = (png_byte *) malloc(png_get_rowbytes(png, info));
-        png_byte *row = row_pointers[y];
-        for (int x = 0; x < width; ++x) {
-            png_byte *dst = &row[x * 4];
-            uint8_t *src = &data[(y * width + x) * 3];
-            dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
-            dst[3] = 255;
-        }
-    }
-    png_write_image(png, row_pointers);
-    png_write_end(png, NULL);
+    rgb.resize(static_cast<size_t>(width) * height * 3);
+    row_pointers.resize(height);
     for (int y = 0; y < height; y++)
-        free(row_pointers[y]);
-    free(row_pointers);
+        row_pointers[y] = &rgb[static_cast<size_t>(y) * width * 3];
+    png_read_image(png, row_pointers.data());
+
+    png_destroy_read_struct(&png, &info, NULL);
     fclose(fp);
     return true;
 }
-
-inline void save_png(const char *path, uint8_t *data, int width, int height) {
-    if (!_save_png(path, data, width, height))
-        fprintf(stderr, "failed to save png file to: %s\n", path);
-}
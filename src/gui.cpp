@@ -4,6 +4,7 @@
 #include <GL/gl3w.h>
 #include <SDL.h>
 #include <thread>
+#include <mutex>
 #include <fstream>
 #include <iomanip>
 #include "raytracer.hpp"
@@ -11,22 +12,93 @@
 
 int width, height, render_width, render_height, image_width, image_height;
 uint8_t *data;
+bool crop;
+int crop_window[4];     // x0, y0, x1, y1 of the pixels to re-render, the rest of the image is kept
+// Progressive preview: the frame is first traced at every PREVIEW_SCALE-th pixel of every
+// PREVIEW_SCALE-th row and blown up to fill the image, then at every half as many pixels, and so
+// on. Each level traces only the pixels the levels before it have not, so that the last one, at
+// the full resolution, finishes the image in the time of a single render. Edits restart from the
+// coarsest level.
+const int PREVIEW_SCALE = 16;
+bool progressive = true;
+int render_scale = 1;   // level being traced, in image pixels per traced pixel
+bool edited;            // set by toolbox widgets that changed the scene or the config this frame
+bool geometry_edited;   // ... and if the change can move the primary hits
+std::atomic<bool> primary_hits_stale;   // to be invalidated before the next render
 std::chrono::high_resolution_clock::time_point time_render_start, time_render_end;
 enum RenderStatus {WAIT_TO_RENDER, RENDERING, RENDERED, EXIT_RENDER} status;
 RayTracer::TraceConfig config;
 RayTracer tracer;
 GLuint tex;
+int tex_width, tex_height;
+
+
+// Pixels of data the render thread has written since the image window last uploaded them to tex.
+// The texture is only re-created when the image is resized; otherwise finished tiles are copied
+// into it with glTexSubImage2D, or all of data if most of it changed.
+struct DirtyTiles {
+    std::mutex mutex;
+    std::vector<RayTracer::Tile> tiles;
+    bool all = false;
+
+    void add(const RayTracer::Tile &tile) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!all) tiles.push_back(tile);
+    }
+
+    void add_all() {
+        std::lock_guard<std::mutex> lock(mutex);
+        all = true;
+        tiles.clear();
+    }
+
+    // returns true if all of data has to be uploaded, and the dirty tiles otherwise
+    bool take(std::vector<RayTracer::Tile> &out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const bool was_all = all;
+        out.swap(tiles);
+        tiles.clear();
+        all = false;
+        return was_all;
+    }
+} dirty;
+
+
+void upload_image() {
+    static std::vector<RayTracer::Tile> tiles;
+    glBindTexture(GL_TEXTURE_2D, tex);
+    if (tex_width != image_width || tex_height != image_height) {
+        dirty.take(tiles);
+        tex_width = image_width, tex_height = image_height;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+        return;
+    }
+    const bool all = dirty.take(tiles);
+    const int num_tile = ((image_width + RayTracer::TILE_SIZE - 1) / RayTracer::TILE_SIZE) *
+                         ((image_height + RayTracer::TILE_SIZE - 1) / RayTracer::TILE_SIZE);
+    if (all || static_cast<int>(tiles.size()) * 2 > num_tile) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, image_width, image_height, GL_RGB, GL_UNSIGNED_BYTE, data);
+        return;
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, image_width);
+    for (const RayTracer::Tile &t : tiles)
+        glTexSubImage2D(GL_TEXTURE_2D, 0, t.x0, t.y0, t.x1 - t.x0, t.y1 - t.y0, GL_RGB, GL_UNSIGNED_BYTE,
+                        data + (static_cast<size_t>(t.y0) * image_width + t.x0) * 3);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
 
 
 void show_image_window() {
     ImGui::Begin("Image");
     auto end = status == RENDERING ? std::chrono::high_resolution_clock::now() : time_render_end;
     double sec = (end - time_render_start).count() / 1e9;
-    ImGui::Text("render size: %d x %d", image_width, image_height);
-    ImGui::Text("rendered %d/%d pixels in %.3fs", tracer.cnt_rendered.load(), image_width * image_height, sec);
+    if (render_scale > 1)
+        ImGui::Text("render size: %d x %d, preview at 1/%d", image_width, image_height, render_scale);
+    else
+        ImGui::Text("render size: %d x %d", image_width, image_height);
+    ImGui::Text("rendered %d/%d pixels in %.3fs", tracer.cnt_rendered.load(), tracer.cnt_total.load(), sec);
 
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, image_width, image_height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+    upload_image();
 
     ImVec2 tex_screen_pos = ImGui::GetCursorScreenPos();
     ImTextureID texid = reinterpret_cast<ImTextureID>(tex);
@@ -48,8 +120,24 @@ void show_image_window() {
 }
 
 
+// cancels the render in progress, if any, and starts over from the coarsest level
+void restart_render() {
+    status = WAIT_TO_RENDER;
+    tracer.stop();
+}
+
+
 void show_toolbox_info() {
     ImGui::Text("GUI FPS: %.1f", ImGui::GetIO().Framerate);
+    // the render thread writes the statistics when it finishes
+    if (config.collect_stats && status == RENDERED) {
+        for (size_t i = 0; i < tracer.scene.bodies.size(); ++i) {
+            const Body *body = tracer.scene.bodies[i];
+            ImGui::Text("body %zu: %zu triangles, loaded in %.3fs, built in %.3fs", i, body->triangles.size(),
+                        body->load_seconds, body->build_seconds);
+        }
+        ImGui::TextUnformatted(tracer.stats.report(tracer.stats_seconds).c_str());
+    }
 }
 
 
@@ -59,15 +147,29 @@ void show_toolbox_render() {
     width = wh[0], height = wh[1];
 
     int rwh[] = {render_width, render_height};
-    ImGui::InputInt2("render_width x render_height", rwh);
+    edited |= ImGui::InputInt2("render_width x render_height", rwh);
     render_width = rwh[0], render_height = rwh[1];
 
-    ImGui::SliderInt("num_trace_depth", &config.num_trace_depth, 1, 10);
-    ImGui::SliderFloat("num_light_sample_per_unit", &config.num_light_sample_per_unit, 1.f, 2000.f);
-    ImGui::SliderInt("num_diffuse_reflect_sample", &config.num_diffuse_reflect_sample, 1, 128);
-    ImGui::SliderInt("workers", &config.num_worker, 1, std::thread::hardware_concurrency());
+    edited |= ImGui::SliderInt("num_trace_depth", &config.num_trace_depth, 1, 10);
+    edited |= ImGui::SliderFloat("num_light_sample_per_unit", &config.num_light_sample_per_unit, 1.f, 2000.f);
+    edited |= ImGui::SliderInt("num_diffuse_reflect_sample", &config.num_diffuse_reflect_sample, 1, 128);
+    edited |= ImGui::SliderInt("workers", &config.num_worker, 1, std::thread::hardware_concurrency());
+    edited |= ImGui::SliderInt("num_light_pick (0: all)", &config.num_light_pick, 0, 16);
+    edited |= ImGui::SliderFloat("irradiance_cache_error (0: off)", &config.irradiance_cache_error, 0.f, 1.f);
+    edited |= ImGui::SliderInt("denoise_passes", &config.denoise_passes, 0, 8);
+    edited |= ImGui::Checkbox("wavefront", &config.wavefront);
+    ImGui::SameLine();
+    edited |= ImGui::Checkbox("sort secondary rays", &config.sort_secondary);
+    ImGui::SameLine();
+    edited |= ImGui::Checkbox("shadow occluder cache", &config.shadow_cache);
+    edited |= ImGui::Checkbox("crop", &crop);
+    ImGui::SameLine();
+    edited |= ImGui::InputInt4("x0, y0, x1, y1", crop_window);
+    ImGui::Checkbox("progressive preview", &progressive);
+    ImGui::SameLine();
+    ImGui::Checkbox("statistics", &config.collect_stats);
 
-    if (ImGui::Button("render")) status = WAIT_TO_RENDER;
+    if (ImGui::Button("render")) restart_render();
     ImGui::SameLine();
     if (ImGui::Button("stop")) tracer.stop();
 }
@@ -85,14 +187,14 @@ void show_toolbox_primitives() {
         if (Sphere *sphere = dynamic_cast<Sphere*>(p)) {
             sprintf(buf, "%zu: Sphere %s###scene-primitive-%zu", i, buf2, i);
             if ((open = ImGui::TreeNode(buf))) {
-                ImGui::DragFloat3("center", sphere->center.data, 0.01f);
-                ImGui::DragFloat("radius", &sphere->radius, 0.001f);
+                geometry_edited |= ImGui::DragFloat3("center", sphere->center.data, 0.01f);
+                geometry_edited |= ImGui::DragFloat("radius", &sphere->radius, 0.001f);
             }
         } else if (Box *box = dynamic_cast<Box*>(p)) {
             sprintf(buf, "%zu: Box %s###scene-primitive-%zu", i, buf2, i);
             if ((open = ImGui::TreeNode(buf))) {
-                ImGui::DragFloat3("pos", box->aabb.pos.data, 0.01f);
-                ImGui::DragFloat3("size", box->aabb.size.data, 0.01f);
+                geometry_edited |= ImGui::DragFloat3("pos", box->aabb.pos.data, 0.01f);
+                geometry_edited |= ImGui::DragFloat3("size", box->aabb.size.data, 0.01f);
             }
         } else if (Triangle *triangle = dynamic_cast<Triangle*>(p)) {
             sprintf(buf, "%zu: Triangle %s###scene-primitive-%zu", i, buf2, i);
@@ -100,8 +202,8 @@ void show_toolbox_primitives() {
         } else if (Plane *plane = dynamic_cast<Plane*>(p)) {
             sprintf(buf, "%zu: Plane %s###scene-primitive-%zu", i, buf2, i);
             if ((open = ImGui::TreeNode(buf))) {
-                ImGui::DragFloat3("normal", plane->normal.data, 0.001f);
-                ImGui::DragFloat("distance", &plane->distance, 0.01f);
+                geometry_edited |= ImGui::DragFloat3("normal", plane->normal.data, 0.001f);
+                geometry_edited |= ImGui::DragFloat("distance", &plane->distance, 0.01f);
             }
         } else {
             sprintf(buf, "%zu: Primitive %s###scene-primitive-%zu", i, buf2, i);
@@ -109,22 +211,22 @@ void show_toolbox_primitives() {
         }
         if (open) {
             bool light = p->light;
-            ImGui::Checkbox("light", &light);
+            edited |= ImGui::Checkbox("light", &light);
             if (light != p->light) {
                 auto &lights = tracer.scene.lights;
                 if (p->light) lights.erase(std::remove(lights.begin(), lights.end(), p));
                 else lights.emplace_back(p);
                 p->light = light;
             }
-            ImGui::ColorEdit3("color", p->material.color.data);
-            ImGui::SliderFloat("k_reflect", &p->material.k_reflect, 0, 1);
-            ImGui::SliderFloat("k_diffuse", &p->material.k_diffuse, 0, 1);
-            ImGui::SliderFloat("k_diffuse_reflect", &p->material.k_diffuse_reflect, 0, 1);
-            ImGui::SliderFloat("k_specular", &p->material.k_specular, 0, 1);
-            ImGui::SliderFloat("k_refract", &p->material.k_refract, 0, 1);
-            ImGui::SliderFloat("k_refract_index", &p->material.k_refract_index, 0, 1.5f);
-            ImGui::DragFloat("texture_uscale", &p->material.texture_uscale, 0.05);
-            ImGui::DragFloat("texture_vscale", &p->material.texture_vscale, 0.05);
+            edited |= ImGui::ColorEdit3("color", p->material.color.data);
+            edited |= ImGui::SliderFloat("k_reflect", &p->material.k_reflect, 0, 1);
+            edited |= ImGui::SliderFloat("k_diffuse", &p->material.k_diffuse, 0, 1);
+            edited |= ImGui::SliderFloat("k_diffuse_reflect", &p->material.k_diffuse_reflect, 0, 1);
+            edited |= ImGui::SliderFloat("k_specular", &p->material.k_specular, 0, 1);
+            edited |= ImGui::SliderFloat("k_refract", &p->material.k_refract, 0, 1);
+            edited |= ImGui::SliderFloat("k_refract_index", &p->material.k_refract_index, 0, 1.5f);
+            edited |= ImGui::DragFloat("texture_uscale", &p->material.texture_uscale, 0.05);
+            edited |= ImGui::DragFloat("texture_vscale", &p->material.texture_vscale, 0.05);
             ImGui::TreePop();
         }
     }
@@ -133,16 +235,19 @@ void show_toolbox_primitives() {
     if (ImGui::Button("new Sphere")) {
         Sphere *sphere = new Sphere(Vector3(0, 0, 0), 0);
         tracer.scene.add(sphere);
+        geometry_edited = true;
     }
     ImGui::SameLine();
     if (ImGui::Button("new Box")) {
         Box *box = new Box(AABB(Vector3(0, 0, 0), Vector3(0, 0, 0)));
         tracer.scene.add(box);
+        geometry_edited = true;
     }
     ImGui::SameLine();
     if (ImGui::Button("new Plane")) {
         Plane *plane = new Plane(Vector3(1, 0, 0), 0);
         tracer.scene.add(plane);
+        geometry_edited = true;
     }
 }
 
@@ -158,6 +263,7 @@ void show_toolbox_body() {
             ImGui::SameLine();
             if (ImGui::Button("scale")) {
                 body->scale(scale);
+                geometry_edited = true;
                 scale = 1.f;
             }
 
@@ -165,6 +271,7 @@ void show_toolbox_body() {
             ImGui::SameLine();
             if (ImGui::Button("offset")) {
                 body->offset(Vector3(offset[0], offset[1], offset[2]));
+                geometry_edited = true;
                 offset[0] = 0, offset[1] = 0, offset[2] = 0;
             }
 
@@ -174,6 +281,7 @@ void show_toolbox_body() {
                 body->rotate_xyz(rotate[0] / 180.0f * static_cast<float>(M_PI),
                                  rotate[1] / 180.0f * static_cast<float>(M_PI),
                                  rotate[2] / 180.0f * static_cast<float>(M_PI));
+                geometry_edited = true;
                 rotate[0] = 0, rotate[1] = 0, rotate[2] = 0;
             }
 
@@ -186,7 +294,10 @@ void show_toolbox_body() {
             changed = ImGui::SliderFloat("k_specular", &material.k_specular, 0, 1) || changed;
             changed = ImGui::SliderFloat("k_refract", &material.k_refract, 0, 1) || changed;
             changed = ImGui::SliderFloat("k_refract_index", &material.k_refract_index, 0, 1.5f) || changed;
-            if (changed) body->set_material(material);
+            if (changed) {
+                body->set_material(material);
+                edited = true;
+            }
             ImGui::TreePop();
         }
     }
@@ -215,6 +326,7 @@ void show_toolbox_scene() {
             fin >> j;
             tracer.scene.clear();
             tracer.scene.from_json(j);
+            geometry_edited = true;
             sprintf(tips, "loaded from %s", filename);
         } else {
             sprintf(tips, "cannot open file %s", filename);
@@ -277,13 +389,17 @@ int main(int argc, char** argv)
     width = 800, height = 600;
     render_width = 400;
     render_height = 300;
+    crop_window[0] = render_width / 4, crop_window[1] = render_height / 4;
+    crop_window[2] = render_width * 3 / 4, crop_window[3] = render_height * 3 / 4;
     data = new uint8_t[render_width * render_height * 3];
     memset(data, 0, sizeof(*data) * render_width * render_height * 3);
     glGenTextures(1, &tex);
     glBindTexture(GL_TEXTURE_2D, tex);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, render_width, render_height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
+    tex_width = render_width, tex_height = render_height;
 
 
     std::ifstream fin("../scene/scene1.json");
@@ -295,12 +411,15 @@ int main(int argc, char** argv)
     config.num_trace_depth = 4;
     config.num_diffuse_reflect_sample = 1;
     config.num_worker = std::thread::hardware_concurrency();
+    config.primary_hit_cache = true;
     status = WAIT_TO_RENDER;
 
     std::thread render_thread([&]{
         while (status != EXIT_RENDER) {
             if (status == WAIT_TO_RENDER) {
                 status = RENDERING;
+                // from here on, an edit's stop() cancels whichever level is being traced, or the next
+                tracer.flag_to_stop = false;
                 if (render_width != image_width || render_height != image_height) {
                     uint8_t *olddata = data;
                     data = new uint8_t[render_width * render_height * 3];
@@ -308,14 +427,57 @@ int main(int argc, char** argv)
                     image_height = render_height;
                     delete [] olddata;
                 }
+                RayTracer::Window window = {0, 0, image_width, image_height};
+                if (crop) {
+                    window.x0 = std::min(std::max(0, crop_window[0]), image_width);
+                    window.y0 = std::min(std::max(0, crop_window[1]), image_height);
+                    window.x1 = std::min(std::max(window.x0, crop_window[2]), image_width);
+                    window.y1 = std::min(std::max(window.y0, crop_window[3]), image_height);
+                }
+                if (primary_hits_stale.exchange(false)) tracer.primary_hits.invalidate();
+                // the preview levels trace into data and fill in the primary hit cache, each adding
+                // to the pixels of the one before; the denoiser needs the whole image, so the last
+                // level traces every pixel again when denoising
+                RayTracer::TraceConfig preview_config = config;
+                preview_config.denoise_passes = 0;
+                const bool preview = progressive && !crop;
                 time_render_start = std::chrono::high_resolution_clock::now();
-                bool success = tracer.render(data, image_width, image_height, config);
+                bool success = true;
+                tracer.on_tile = nullptr;
+                for (render_scale = preview ? PREVIEW_SCALE : 1; render_scale > 1; render_scale /= 2) {
+                    const int s = render_scale;
+                    preview_config.pixel_step = s;
+                    preview_config.skip_coarser_pixels = s < PREVIEW_SCALE;
+                    success = tracer.render(data, image_width, image_height, preview_config) && status == RENDERING;
+                    if (!success) break;
+                    // every s x s block takes the color of its top left pixel, traced at this level or before
+                    for (int y = 0; y < image_height; ++y) {
+                        const uint8_t *src = data + static_cast<size_t>(y - y % s) * image_width * 3;
+                        uint8_t *dst = data + static_cast<size_t>(y) * image_width * 3;
+                        for (int x = 0; x < image_width; ++x)
+                            if (x % s || y % s) memcpy(dst + x * 3, src + (x - x % s) * 3, 3);
+                    }
+                    dirty.add_all();
+                }
+                // an edit after the last preview level has asked for the next render already
+                success = success && status == RENDERING;
+                if (success) {
+                    render_scale = 1;
+                    RayTracer::TraceConfig final_config = config;
+                    final_config.skip_coarser_pixels = preview && config.denoise_passes == 0;
+                    tracer.on_tile = [window](const RayTracer::Tile &t) {
+                        dirty.add({t.x0 + window.x0, t.y0 + window.y0, t.x1 + window.x0, t.y1 + window.y0});
+                    };
+                    success = tracer.render(data + (window.y0 * image_width + window.x0) * 3, image_width,
+                                            image_width, image_height, window, final_config);
+                }
                 time_render_end = std::chrono::high_resolution_clock::now();
                 if (success)
                     save_png("/tmp/ray-tracing.png", data, render_width, render_height);
                 else if (status == EXIT_RENDER)
                     return;
-                status = RENDERED;
+                // an edit during the render has asked for the next one already
+                if (status == RENDERING) status = RENDERED;
             } else {
                 std::this_thread::sleep_for(std::chrono::milliseconds(10));
             }
@@ -344,6 +506,11 @@ int main(int argc, char** argv)
 
         show_toolbox_window();
         show_image_window();
+        if (geometry_edited) primary_hits_stale = true;
+        if (edited || geometry_edited) {
+            edited = geometry_edited = false;
+            restart_render();
+        }
 
         // Rendering
         glViewport(0, 0, (int)ImGui::GetIO().DisplaySize.x, (int)ImGui::GetIO().DisplaySize.y);
@@ -0,0 +1,441 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// RGB image memory, mapped either anonymously or from a scratch file. Pages are only touched when
+// rendered, and rows that were already written out can be given back with release_rows.
+struct Framebuffer {
+    int width, height;
+    uint8_t *data;
+    size_t size;
+
+    Framebuffer() : width(0), height(0), data(nullptr), size(0) {}
+
+    Framebuffer(const Framebuffer &) = delete;
+
+    Framebuffer &operator=(const Framebuffer &) = delete;
+
+    ~Framebuffer() { free(); }
+
+    bool allocate(int width_, int height_) {
+        return map(width_, height_, -1);
+    }
+
+    // the scratch file at `path` is unlinked right away and lives as long as the mapping
+    bool allocate_file(const char *path, int width_, int height_) {
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) return false;
+        unlink(path);
+        bool ok = ftruncate(fd, static_cast<off_t>(width_) * height_ * 3) == 0 && map(width_, height_, fd);
+        ::close(fd);
+        return ok;
+    }
+
+    uint8_t *row(int y) const { return data + static_cast<size_t>(y) * width * 3; }
+
+    // give the whole pages inside rows [y0, y1) back to the system
+    void release_rows(int y0, int y1) {
+        const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t begin = (reinterpret_cast<uintptr_t>(row(y0)) + page - 1) / page * page;
+        uintptr_t end = reinterpret_cast<uintptr_t>(row(y1));
+        if (y1 < height) end = end / page * page;
+        if (end > begin) madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+
+    void free() {
+        if (data) munmap(data, size);
+        data = nullptr;
+        size = 0;
+    }
+
+private:
+    bool map(int width_, int height_, int fd) {
+        free();
+        width = width_;
+        height = height_;
+        size = static_cast<size_t>(width) * height * 3;
+        void *p = fd < 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)
+                         : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        data = static_cast<uint8_t *>(p);
+        return true;
+    }
+};
+
+
+// how ImageWriter encodes its output
+struct EncodeOptions {
+    // per-row PNG filter; ADAPTIVE picks the one with the smallest sum of absolute residuals
+    enum Filter { NONE = 0, SUB = 1, UP = 2, AVERAGE = 3, PAETH = 4, ADAPTIVE = 5 };
+
+    int compression_level;  // zlib level, 0 (store) .. 9
+    Filter filter;
+    int num_threads;        // 0: hardware concurrency
+
+    EncodeOptions() : compression_level(6), filter(ADAPTIVE), num_threads(0) {}
+
+    static bool parse_filter(const std::string &name, Filter &filter) {
+        static const char *names[] = {"none", "sub", "up", "average", "paeth", "adaptive"};
+        for (int i = 0; i <= ADAPTIVE; ++i)
+            if (name == names[i]) {
+                filter = static_cast<Filter>(i);
+                return true;
+            }
+        return false;
+    }
+};
+
+
+// writes an RGB image to disk in top-to-bottom row bands
+struct ImageWriter {
+    virtual ~ImageWriter() {}
+
+    // `rows` holds n rows of width * 3 bytes; they may be reused as soon as this returns
+    virtual bool write_rows(const uint8_t *rows, int n) = 0;
+
+    virtual bool close() = 0;
+
+    // a PPMWriter for *.ppm, a PFMWriter for *.pfm, a PNGWriter otherwise
+    static std::unique_ptr<ImageWriter> open(const char *path, int width, int height,
+                                             const EncodeOptions &options = EncodeOptions());
+};
+
+
+// PNG encoder that filters and deflates strips of rows on worker threads. Every strip is an
+// independent raw deflate stream ended by a sync flush, so the strips are simply concatenated
+// into one zlib stream whose adler32 is combined from the per-strip checksums, like pigz does.
+struct PNGWriter : public ImageWriter {
+    static constexpr int STRIP_ROWS = 32;
+
+    FILE *fp;
+    int width;
+    EncodeOptions options;
+
+    PNGWriter() : fp(nullptr), width(0), adler(1), failed(false) {}
+
+    ~PNGWriter() { close(); }
+
+    bool open(const char *path, int width_, int height, const EncodeOptions &options_ = EncodeOptions()) {
+        width = width_;
+        options = options_;
+        if (options.num_threads <= 0) options.num_threads = std::max(1u, std::thread::hardware_concurrency());
+        options.compression_level = std::max(0, std::min(9, options.compression_level));
+        prev_row.assign(stride(), 0);
+        fp = fopen(path, "wb");
+        if (!fp) return false;
+
+        static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        uint8_t ihdr[13];
+        put_be32(ihdr, static_cast<uint32_t>(width));
+        put_be32(ihdr + 4, static_cast<uint32_t>(height));
+        ihdr[8] = 8;            // bit depth
+        ihdr[9] = 2;            // truecolor
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+        // zlib header: deflate with a 32K window, FLEVEL hint from the level, FCHECK so that it is a multiple of 31
+        const int level = options.compression_level;
+        uint8_t zlib_header[2] = {0x78, static_cast<uint8_t>((level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6)};
+        zlib_header[1] += 31 - (zlib_header[0] * 256 + zlib_header[1]) % 31;
+        fwrite(signature, 1, sizeof(signature), fp);
+        write_chunk("IHDR", ihdr, sizeof(ihdr));
+        write_chunk("IDAT", zlib_header, sizeof(zlib_header));
+        return !ferror(fp);
+    }
+
+    bool write_rows(const uint8_t *rows, int n) override {
+        if (!fp) return false;
+        const size_t stride_ = stride();
+        for (int y = 0; y < n; y += STRIP_ROWS) {
+            const int cnt = std::min(STRIP_ROWS, n - y);
+            // the strip owns a copy of its rows, preceded by the row above for the UP/AVERAGE/PAETH filters
+            std::vector<uint8_t> raw(stride_ * (cnt + 1));
+            memcpy(raw.data(), prev_row.data(), stride_);
+            memcpy(raw.data() + stride_, rows + y * stride_, stride_ * cnt);
+            memcpy(prev_row.data(), rows + (y + cnt - 1) * stride_, stride_);
+
+            while (pending.size() >= static_cast<size_t>(options.num_threads)) flush_strip();
+            const EncodeOptions opts = options;
+            pending.push_back(std::async(std::launch::async, [opts, stride_, cnt](std::vector<uint8_t> raw) {
+                return encode_strip(raw, stride_, cnt, opts);
+            }, std::move(raw)));
+        }
+        return !failed;
+    }
+
+    bool close() override {
+        if (!fp) return false;
+        while (!pending.empty()) flush_strip();
+        // an empty final fixed-huffman block terminates the deflate stream, then the adler32 of all filtered rows
+        uint8_t tail[6] = {0x03, 0x00};
+        put_be32(tail + 2, adler);
+        write_chunk("IDAT", tail, sizeof(tail));
+        write_chunk("IEND", nullptr, 0);
+        bool ok = !failed && !ferror(fp);
+        ok = fclose(fp) == 0 && ok;
+        fp = nullptr;
+        return ok;
+    }
+
+private:
+    struct Strip {
+        std::vector<uint8_t> data;  // raw deflate, ending on a byte boundary
+        uLong adler;                // of the filtered rows
+        size_t length;              // of the filtered rows
+        bool ok;
+    };
+
+    uLong adler;
+    bool failed;
+    std::vector<uint8_t> prev_row;
+    std::deque<std::future<Strip>> pending;
+
+    size_t stride() const { return static_cast<size_t>(width) * 3; }
+
+    void flush_strip() {
+        Strip strip = pending.front().get();
+        pending.pop_front();
+        failed = failed || !strip.ok;
+        adler = adler32_combine(adler, strip.adler, static_cast<z_off_t>(strip.length));
+        write_chunk("IDAT", strip.data.data(), strip.data.size());
+    }
+
+    static void put_be32(uint8_t *p, uint32_t v) {
+        p[0] = static_cast<uint8_t>(v >> 24), p[1] = static_cast<uint8_t>(v >> 16);
+        p[2] = static_cast<uint8_t>(v >> 8), p[3] = static_cast<uint8_t>(v);
+    }
+
+    void write_chunk(const char *type, const uint8_t *data, size_t size) {
+        uint8_t header[8];
+        put_be32(header, static_cast<uint32_t>(size));
+        memcpy(header + 4, type, 4);
+        uLong crc = crc32(0, reinterpret_cast<const Bytef *>(type), 4);
+        if (size) crc = crc32(crc, data, static_cast<uInt>(size));
+        uint8_t footer[4];
+        put_be32(footer, static_cast<uint32_t>(crc));
+        fwrite(header, 1, sizeof(header), fp);
+        if (size) fwrite(data, 1, size, fp);
+        fwrite(footer, 1, sizeof(footer), fp);
+    }
+
+    static uint8_t paeth(int a, int b, int c) {
+        int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+        return static_cast<uint8_t>(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+    }
+
+    // filters row `cur` (with `up` above it) into out[1..stride], out[0] gets the filter type
+    static void filter_row(int type, const uint8_t *cur, const uint8_t *up, size_t stride, uint8_t *out) {
+        out[0] = static_cast<uint8_t>(type);
+        ++out;
+        for (size_t i = 0; i < stride; ++i) {
+            const int a = i >= 3 ? cur[i - 3] : 0, b = up[i], c = i >= 3 ? up[i - 3] : 0;
+            switch (type) {
+                case EncodeOptions::NONE: out[i] = cur[i]; break;
+                case EncodeOptions::SUB: out[i] = static_cast<uint8_t>(cur[i] - a); break;
+                case EncodeOptions::UP: out[i] = static_cast<uint8_t>(cur[i] - b); break;
+                case EncodeOptions::AVERAGE: out[i] = static_cast<uint8_t>(cur[i] - (a + b) / 2); break;
+                default: out[i] = static_cast<uint8_t>(cur[i] - paeth(a, b, c)); break;
+            }
+        }
+    }
+
+    static size_t residual(const uint8_t *out, size_t stride) {
+        size_t sum = 0;
+        for (size_t i = 1; i <= stride; ++i) sum += out[i] < 128 ? out[i] : 256 - out[i];
+        return sum;
+    }
+
+    // raw[0 .. stride) is the row above the strip, which is all zeros for the first strip
+    static Strip encode_strip(const std::vector<uint8_t> &raw, size_t stride, int num_rows, const EncodeOptions &options) {
+        std::vector<uint8_t> filtered((stride + 1) * num_rows), trial(stride + 1);
+        for (int y = 0; y < num_rows; ++y) {
+            const uint8_t *up = &raw[stride * y], *cur = up + stride;
+            uint8_t *out = &filtered[(stride + 1) * y];
+            if (options.filter != EncodeOptions::ADAPTIVE) {
+                filter_row(options.filter, cur, up, stride, out);
+                continue;
+            }
+            size_t best = std::numeric_limits<size_t>::max();
+            for (int type = EncodeOptions::NONE; type <= EncodeOptions::PAETH; ++type) {
+                filter_row(type, cur, up, stride, trial.data());
+                size_t sum = residual(trial.data(), stride);
+                if (sum < best) best = sum, memcpy(out, trial.data(), stride + 1);
+            }
+        }
+
+        Strip strip;
+        strip.length = filtered.size();
+        strip.adler = adler32(adler32(0, nullptr, 0), filtered.data(), static_cast<uInt>(filtered.size()));
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        strip.ok = deflateInit2(&zs, options.compression_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!strip.ok) return strip;
+        strip.data.resize(deflateBound(&zs, filtered.size()) + 16);
+        zs.next_in = filtered.data();
+        zs.avail_in = static_cast<uInt>(filtered.size());
+        zs.next_out = strip.data.data();
+        zs.avail_out = static_cast<uInt>(strip.data.size());
+        strip.ok = deflate(&zs, Z_SYNC_FLUSH) == Z_OK && zs.avail_in == 0;
+        strip.data.resize(zs.total_out);
+        deflateEnd(&zs);
+        return strip;
+    }
+};
+
+
+// binary P6
+struct PPMWriter : public ImageWriter {
+    FILE *f;
+    int width;
+
+    PPMWriter() : f(nullptr), width(0) {}
+
+    ~PPMWriter() { close(); }
+
+    bool open(const char *path, int width_, int height) {
+        width = width_;
+        f = fopen(path, "wb");
+        if (!f) return false;
+        fprintf(f, "P6\n%d %d\n255\n", width, height);
+        return true;
+    }
+
+    bool write_rows(const uint8_t *rows, int n) override {
+        const size_t size = static_cast<size_t>(width) * 3 * n;
+        return f && fwrite(rows, 1, size, f) == size;
+    }
+
+    bool close() override {
+        if (!f) return false;
+        bool ok = fclose(f) == 0;
+        f = nullptr;
+        return ok;
+    }
+};
+
+
+// little-endian float RGB in [0, 1]; PFM stores its rows bottom to top, so each band is written
+// at its offset from the end of the file
+struct PFMWriter : public ImageWriter {
+    FILE *f;
+    int width, height, next_row;
+    long header_size;
+
+    PFMWriter() : f(nullptr), width(0), height(0), next_row(0), header_size(0) {}
+
+    ~PFMWriter() { close(); }
+
+    bool open(const char *path, int width_, int height_) {
+        width = width_;
+        height = height_;
+        next_row = 0;
+        f = fopen(path, "wb");
+        if (!f) return false;
+        fprintf(f, "PF\n%d %d\n-1.0\n", width, height);
+        header_size = ftell(f);
+        return true;
+    }
+
+    bool write_rows(const uint8_t *rows, int n) override {
+        if (!f) return false;
+        std::vector<float> line(static_cast<size_t>(width) * 3);
+        for (int y = 0; y < n; ++y, ++next_row) {
+            const uint8_t *row = rows + static_cast<size_t>(y) * width * 3;
+            for (size_t i = 0; i < line.size(); ++i) line[i] = row[i] / 255.f;
+            const long offset = header_size + static_cast<long>(height - 1 - next_row) * width * 3 * sizeof(float);
+            if (fseek(f, offset, SEEK_SET) != 0 || fwrite(line.data(), sizeof(float), line.size(), f) != line.size())
+                return false;
+        }
+        return true;
+    }
+
+    bool close() override {
+        if (!f) return false;
+        bool ok = fclose(f) == 0;
+        f = nullptr;
+        return ok;
+    }
+};
+
+
+inline bool has_extension(const char *path, const char *ext) {
+    const size_t len = strlen(path), ext_len = strlen(ext);
+    return len >= ext_len && strcmp(path + len - ext_len, ext) == 0;
+}
+
+inline std::unique_ptr<ImageWriter> ImageWriter::open(const char *path, int width, int height,
+                                                      const EncodeOptions &options) {
+    if (has_extension(path, ".ppm")) {
+        std::unique_ptr<PPMWriter> writer(new PPMWriter);
+        if (writer->open(path, width, height)) return writer;
+    } else if (has_extension(path, ".pfm")) {
+        std::unique_ptr<PFMWriter> writer(new PFMWriter);
+        if (writer->open(path, width, height)) return writer;
+    } else {
+        std::unique_ptr<PNGWriter> writer(new PNGWriter);
+        if (writer->open(path, width, height, options)) return writer;
+    }
+    return nullptr;
+}
+
+
+inline void save_ppm(const char *path, const uint8_t *data, int width, int height) {
+    PPMWriter writer;
+    if (!writer.open(path, width, height) || !writer.write_rows(data, height) || !writer.close())
+        fprintf(stderr, "failed to save ppm file to: %s\n", path);
+}
+
+inline void save_png(const char *path, const uint8_t *data, int width, int height,
+                     const EncodeOptions &options = EncodeOptions()) {
+    PNGWriter writer;
+    if (!writer.open(path, width, height, options) || !writer.write_rows(data, height) || !writer.close())
+        fprintf(stderr, "failed to save png file to: %s\n", path);
+}
+
+// single channel little-endian float PFM ("Pf"), rows bottom to top
+inline bool save_pfm_gray(const char *path, const float *data, int width, int height) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+    bool ok = fprintf(f, "Pf\n%d %d\n-1.0\n", width, height) > 0;
+    for (int y = height - 1; ok && y >= 0; --y)
+        ok = fwrite(data + static_cast<size_t>(y) * width, sizeof(float), width, f) == static_cast<size_t>(width);
+    return fclose(f) == 0 && ok;
+}
+
+// Colors values on a log scale from black (0) through blue, cyan, green and yellow to red, which
+// is reached at the 99.9th percentile `top` so that a few outliers (such as pixels whose thread was
+// preempted) do not wash out the rest; cheap and expensive regions both keep some contrast.
+inline void heatmap(const float *values, int width, int height, uint8_t *rgb, float &top) {
+    static const float stops[6][3] = {{0, 0, 0}, {0, 0, 255}, {0, 255, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}};
+    const size_t n = static_cast<size_t>(width) * height;
+    top = 0;
+    if (n) {
+        std::vector<float> sorted(values, values + n);
+        std::nth_element(sorted.begin(), sorted.begin() + n * 999 / 1000, sorted.end());
+        top = sorted[n * 999 / 1000];
+    }
+    const float scale = top > 0 ? 5 / logf(1 + top) : 0;
+    for (size_t i = 0; i < n; ++i) {
+        const float t = std::min(5.f, logf(1 + std::max(values[i], 0.f)) * scale);
+        const int k = std::min(4, static_cast<int>(t));
+        const float f = t - k;
+        for (int c = 0; c < 3; ++c)
+            rgb[i * 3 + c] = static_cast<uint8_t>(stops[k][c] + (stops[k + 1][c] - stops[k][c]) * f + .5f);
+    }
+}
@@ -0,0 +1,231 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include "geometry.hpp"
+
+// Irradiance cache (Ward et al., with the gradients of Ward & Heckbert) for the diffuse reflection
+// of primary hits. A record keeps the mean radiance E arriving over the hemisphere at a point, as
+// ray_trace averages it, together with its gradients under translation and rotation and the
+// harmonic mean distance R of the surfaces seen from there. A record is valid at point p with
+// normal N where  |p - p_i| / R_i + sqrt(1 - N . N_i) < error;  where records are valid, E is the
+// weighted mean of their first-order extrapolations, and elsewhere a new record is sampled.
+// Records are kept in an octree that grows as needed and is shared by all threads: lookups, by far
+// the most calls, share a reader lock, and inserts take it exclusively.
+struct IrradianceCache {
+    struct Record {
+        Vector3 p, N;
+        Color E;
+        float radius;           // R_i
+        Vector3 grad_t[3];      // of E.r, E.g, E.b with respect to position
+        Vector3 grad_r[3];      // of E.r, E.g, E.b with respect to rotation of the normal
+    };
+
+    // stratified hemisphere directions at one point: num_theta rows of equal solid angle, from the
+    // normal down to the horizon, times num_phi sectors. The integrator traces every direction and
+    // fills in radiance and distance (infinite for misses).
+    struct Samples {
+        int num_theta, num_phi;
+        Vector3 Nx, Ny, Nz;     // Ny is the normal
+        std::vector<Vector3> directions;    // row by row
+        std::vector<Color> radiance;
+        std::vector<float> distance;
+
+        Samples(const Vector3 &N, int num_sample) {
+            num_theta = std::max(1, static_cast<int>(sqrtf(num_sample / static_cast<float>(M_PI)) + .5f));
+            num_phi = std::max(1, num_sample / num_theta);
+            Ny = N;
+            if (fabsf(Ny.x) > fabs(Ny.y)) Nx = Vector3(Ny.z, 0, -Ny.x);
+            else Nx = Vector3(0, -Ny.z, Ny.y);
+            Nx = Nx.normalized();
+            Nz = Ny.cross(Nx).normalized();
+            for (int j = 0; j < num_theta; ++j) {
+                for (int k = 0; k < num_phi; ++k) {
+                    float cos_theta = 1 - (j + randf()) / num_theta;
+                    float sin_theta = sqrtf(std::max(0.f, 1 - cos_theta * cos_theta));
+                    float phi = 2 * static_cast<float>(M_PI) * (k + randf()) / num_phi;
+                    directions.push_back(Nx * (sin_theta * cosf(phi)) + Ny * cos_theta + Nz * (sin_theta * sinf(phi)));
+                }
+            }
+            radiance.resize(directions.size());
+            distance.resize(directions.size(), std::numeric_limits<float>::infinity());
+        }
+
+        // unit vector of the tangent plane at azimuth phi
+        Vector3 horizon(float phi) const { return Nx * cosf(phi) + Nz * sinf(phi); }
+    };
+
+    // validity radii are kept between these many pixel footprints of the hit
+    static constexpr float MIN_RADIUS_FOOTPRINTS = 3.f;
+    static constexpr float MAX_RADIUS_FOOTPRINTS = 100.f;
+
+    IrradianceCache() {}
+
+    IrradianceCache(const IrradianceCache &) = delete;
+
+    IrradianceCache &operator=(const IrradianceCache &) = delete;
+
+    // drops every record; error is the tolerance of the records that follow
+    void reset(float error_) {
+        std::lock_guard<std::shared_timed_mutex> lock(mutex);
+        error = error_;
+        records.clear();
+        root.reset();
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        return records.size();
+    }
+
+    bool lookup(const Vector3 &p, const Vector3 &N, Color &E) const {
+        std::shared_lock<std::shared_timed_mutex> lock(mutex);
+        if (!root) return false;
+        Color sum(0, 0, 0);
+        float sum_weight = 0;
+        lookup(root.get(), p, N, sum, sum_weight);
+        if (sum_weight <= 0) return false;
+        E = max(sum / sum_weight, Color(0, 0, 0));
+        return true;
+    }
+
+    // footprint: world space width of a pixel at p; returns the record's E
+    Color insert(const Vector3 &p, const Vector3 &N, float footprint, const Samples &s) {
+        Record r = make_record(p, N, footprint, s);
+        std::lock_guard<std::shared_timed_mutex> lock(mutex);
+        const float search_radius = error * r.radius;
+        while (!root || !contains(*root, p, 1.f) || root->half < 2 * search_radius) grow(p, search_radius);
+        Node *node = root.get();
+        while (node->half / 2 >= 2 * search_radius) {
+            const int octant = (p.x >= node->center.x) | (p.y >= node->center.y) << 1 | (p.z >= node->center.z) << 2;
+            std::unique_ptr<Node> &child = node->child[octant];
+            if (!child) child.reset(new Node(child_center(*node, octant), node->half / 2));
+            node = child.get();
+        }
+        node->records.push_back(static_cast<uint32_t>(records.size()));
+        records.push_back(r);
+        return r.E;
+    }
+
+private:
+    // a record at p_i within the cube [center - half, center + half] has a validity sphere of
+    // radius at most half / 2, which stays inside the cube grown by half / 2
+    struct Node {
+        Vector3 center;
+        float half;
+        std::unique_ptr<Node> child[8];
+        std::vector<uint32_t> records;
+
+        Node(const Vector3 &center_, float half_) : center(center_), half(half_) {}
+    };
+
+    mutable std::shared_timed_mutex mutex;
+    float error = 0;
+    std::vector<Record> records;
+    std::unique_ptr<Node> root;
+
+    static bool contains(const Node &node, const Vector3 &p, float scale) {
+        const float h = node.half * scale;
+        return fabsf(p.x - node.center.x) <= h && fabsf(p.y - node.center.y) <= h && fabsf(p.z - node.center.z) <= h;
+    }
+
+    static Vector3 child_center(const Node &node, int octant) {
+        const float h = node.half / 2;
+        return node.center + Vector3(octant & 1 ? h : -h, octant & 2 ? h : -h, octant & 4 ? h : -h);
+    }
+
+    // doubles the root towards p, so that the old root becomes one of its children
+    void grow(const Vector3 &p, float search_radius) {
+        if (!root) {
+            root.reset(new Node(p, std::max(2 * search_radius, 1e-3f)));
+            return;
+        }
+        const Vector3 &c = root->center;
+        const float h = root->half;
+        std::unique_ptr<Node> parent(new Node(c + Vector3(p.x >= c.x ? h : -h, p.y >= c.y ? h : -h, p.z >= c.z ? h : -h),
+                                              2 * h));
+        const int octant = (c.x >= parent->center.x) | (c.y >= parent->center.y) << 1 | (c.z >= parent->center.z) << 2;
+        parent->child[octant] = std::move(root);
+        root = std::move(parent);
+    }
+
+    void lookup(const Node *node, const Vector3 &p, const Vector3 &N, Color &sum, float &sum_weight) const {
+        if (!contains(*node, p, 1.5f)) return;
+        for (uint32_t i : node->records) {
+            const Record &r = records[i];
+            const Vector3 d = p - r.p;
+            // records behind p would extrapolate into a shadowed region
+            if (d.dot(r.N + N) * .5f < -.05f * r.radius) continue;
+            const float e = d.length() / r.radius + sqrtf(std::max(0.f, 1 - N.dot(r.N)));
+            if (e >= error) continue;
+            const float w = 1 / std::max(e, 1e-4f);
+            const Vector3 rotation = r.N.cross(N);
+            for (int c = 0; c < 3; ++c)
+                sum.data[c] += w * (r.E.data[c] + d.dot(r.grad_t[c]) + rotation.dot(r.grad_r[c]));
+            sum_weight += w;
+        }
+        for (const std::unique_ptr<Node> &child : node->child)
+            if (child) lookup(child.get(), p, N, sum, sum_weight);
+    }
+
+    // E is the mean of the samples. The gradients follow Ward & Heckbert, for strata of equal
+    // solid angle instead of cosine weighted ones: moving p lets the nearer of two neighbouring
+    // strata cover the farther one, at a rate given by the nearer distance; rotating N moves the
+    // horizon, which is seen by the last row.
+    Record make_record(const Vector3 &p, const Vector3 &N, float footprint, const Samples &s) const {
+        const int M = s.num_theta, K = s.num_phi;
+        auto L = [&](int j, int k) -> const Color & { return s.radiance[j * K + (k + K) % K]; };
+        // kept off 0, where a sample started on a touching surface, so that the gradients stay finite
+        auto min_distance = [&](int j0, int k0, int j1, int k1) {
+            return std::max(std::min(s.distance[j0 * K + (k0 + K) % K], s.distance[j1 * K + (k1 + K) % K]), EPS);
+        };
+        const float two_pi = 2 * static_cast<float>(M_PI);
+
+        Record r;
+        r.p = p, r.N = N;
+        r.E = Color(0, 0, 0);
+        float inv_distance = 0;
+        for (size_t i = 0; i < s.radiance.size(); ++i) {
+            r.E += s.radiance[i];
+            inv_distance += 1 / s.distance[i];
+        }
+        r.E = r.E / static_cast<float>(s.radiance.size());
+        r.radius = inv_distance > 0 ? s.radiance.size() / inv_distance : std::numeric_limits<float>::infinity();
+
+        for (int c = 0; c < 3; ++c) r.grad_t[c] = r.grad_r[c] = Vector3(0, 0, 0);
+        for (int k = 0; k < K; ++k) {
+            // boundary between sectors k - 1 and k, along every row
+            const float phi = two_pi * k / K;
+            const Vector3 u_phi = s.Nx * -sinf(phi) + s.Nz * cosf(phi);
+            for (int j = 0; j < M; ++j) {
+                const float d_theta = acosf(1 - (j + 1.f) / M) - acosf(1 - static_cast<float>(j) / M);
+                const Color diff = (L(j, k) - L(j, k - 1)) * (d_theta / min_distance(j, k, j, k - 1));
+                for (int c = 0; c < 3; ++c) r.grad_t[c] += u_phi * (diff.data[c] / two_pi);
+            }
+            // boundary between rows j - 1 and j, along sector k
+            const Vector3 h = s.horizon(two_pi * (k + .5f) / K);
+            for (int j = 1; j < M; ++j) {
+                const float cos_theta = 1 - static_cast<float>(j) / M;
+                const float sin_theta = sqrtf(1 - cos_theta * cos_theta);
+                const Color diff = (L(j, k) - L(j - 1, k)) * (sin_theta * cos_theta / K / min_distance(j, k, j - 1, k));
+                for (int c = 0; c < 3; ++c) r.grad_t[c] += h * diff.data[c];
+            }
+            // horizon
+            const Vector3 axis = N.cross(h);
+            for (int c = 0; c < 3; ++c) r.grad_r[c] += axis * (L(M - 1, k).data[c] / K);
+        }
+
+        // keep the extrapolation over the validity radius from overshooting E
+        for (int c = 0; c < 3; ++c) {
+            const float g = r.grad_t[c].length();
+            if (g > 0) r.radius = std::min(r.radius, r.E.data[c] / g);
+        }
+        footprint = std::max(footprint, EPS);
+        r.radius = std::max(MIN_RADIUS_FOOTPRINTS * footprint, std::min(MAX_RADIUS_FOOTPRINTS * footprint, r.radius));
+        return r;
+    }
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <cstddef>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a whole file mapped into memory
+struct MappedFile {
+    char *data;
+    size_t size;
+
+    MappedFile() : data(nullptr), size(0) {}
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // private copy-on-write mapping: pages stay shared with the page cache until written
+    bool open(const char *path) {
+        close();
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) return false;
+        data = static_cast<char *>(p);
+        size = static_cast<size_t>(st.st_size);
+        madvise(data, size, MADV_WILLNEED);
+        return true;
+    }
+
+    void close() {
+        if (data) munmap(data, size);
+        data = nullptr;
+        size = 0;
+    }
+
+    ~MappedFile() { close(); }
+};
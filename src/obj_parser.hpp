@@ -0,0 +1,263 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <vector>
+#include "mapped_file.hpp"
+#include "task_pool.hpp"
+
+// Wavefront .obj reader. The file is memory-mapped and split into chunks at line boundaries.
+// A first parallel pass counts the statements of every chunk, so that the second parallel pass
+// can parse each chunk straight into its slice of the flat output arrays.
+// Supports `v`, `vn` and `f` with `v`, `v/vt`, `v//vn` or `v/vt/vn` corners, negative indices
+// and polygons (fan triangulated); other statements, `#` comments and face tokens that are not
+// corners are skipped.
+struct ObjMesh {
+    std::vector<float> positions;   // x y z of every `v`
+    std::vector<float> normals;     // x y z of every `vn`
+    std::vector<int> corners;       // per triangle corner: position index, normal index or -1
+
+    size_t num_triangles() const { return corners.size() / 6; }
+
+    bool load(const char *path, int num_threads = 0) {
+        MappedFile file;
+        if (!file.open(path)) {
+            fprintf(stderr, "failed to open obj file: %s\n", path);
+            return false;
+        }
+        if (num_threads <= 0) num_threads = TaskPool::instance().num_threads();
+        const char *begin = file.data, *end = file.data + file.size;
+
+        // chunk boundaries: right after a newline
+        const int n = static_cast<int>(std::min<size_t>(num_threads, file.size / 65536 + 1));
+        std::vector<const char *> bound(n + 1, end);
+        bound[0] = begin;
+        for (int i = 1; i < n; ++i) {
+            const char *p = begin + file.size * i / n;
+            p = std::max(p, bound[i - 1]);
+            while (p < end && *p != '\n') ++p;
+            bound[i] = p < end ? p + 1 : end;
+        }
+
+        std::vector<Counts> counts(n + 1);
+        parallel_for(n, [&](int i) { count(bound[i], bound[i + 1], counts[i + 1]); });
+        for (int i = 1; i <= n; ++i) counts[i] += counts[i - 1];   // prefix sums: offsets of chunk i
+        const Counts &total = counts[n];
+        positions.resize(total.positions * 3);
+        normals.resize(total.normals * 3);
+        corners.resize(total.triangles * 6);
+
+        std::atomic<bool> ok(true);
+        parallel_for(n, [&](int i) {
+            if (!parse(bound[i], bound[i + 1], counts[i], total)) ok = false;
+        });
+        if (!ok) fprintf(stderr, "failed to parse obj file: %s\n", path);
+        return ok;
+    }
+
+private:
+    struct Counts {
+        size_t positions = 0, normals = 0, triangles = 0;
+
+        Counts &operator+=(const Counts &c) {
+            positions += c.positions, normals += c.normals, triangles += c.triangles;
+            return *this;
+        }
+    };
+
+    template <typename Func>
+    static void parallel_for(int n, const Func &func) {
+        TaskPool::Group group;
+        for (int i = 0; i < n; ++i) group.run([&func, i] { func(i); });
+        group.wait();
+    }
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+    static const char *skip_space(const char *p, const char *end) {
+        while (p < end && is_space(*p)) ++p;
+        return p;
+    }
+
+    // end of the statement: newline or comment
+    static bool is_end(const char *p, const char *end) { return p >= end || *p == '\n' || *p == '#'; }
+
+    static const char *skip_token(const char *p, const char *end) {
+        while (!is_end(p, end) && !is_space(*p)) ++p;
+        return p;
+    }
+
+    // a face token is a corner if it starts with a position index; count and parse agree on this
+    static bool is_corner(const char *p, const char *end) {
+        if (p < end && (*p == '-' || *p == '+')) ++p;
+        return p < end && *p >= '0' && *p <= '9';
+    }
+
+    static const char *skip_line(const char *p, const char *end) {
+        while (p < end && *p != '\n') ++p;
+        return p < end ? p + 1 : end;
+    }
+
+    // statement keyword at p, which is the first non-space character of a line
+    enum Keyword { OTHER, V, VN, F };
+
+    static Keyword keyword(const char *p, const char *end) {
+        if (p + 1 >= end) return OTHER;
+        if (p[0] == 'v') {
+            if (is_space(p[1])) return V;
+            if (p[1] == 'n' && p + 2 < end && is_space(p[2])) return VN;
+        } else if (p[0] == 'f' && is_space(p[1])) {
+            return F;
+        }
+        return OTHER;
+    }
+
+    static void count(const char *p, const char *end, Counts &c) {
+        while (p < end) {
+            p = skip_space(p, end);
+            switch (keyword(p, end)) {
+                case V: ++c.positions; break;
+                case VN: ++c.normals; break;
+                case F: {
+                    int num_corner = 0;
+                    for (++p;;) {
+                        p = skip_space(p, end);
+                        if (is_end(p, end)) break;
+                        if (is_corner(p, end)) ++num_corner;
+                        p = skip_token(p, end);
+                    }
+                    if (num_corner >= 3) c.triangles += num_corner - 2;
+                    break;
+                }
+                default: break;
+            }
+            p = skip_line(p, end);
+        }
+    }
+
+    static const char *parse_int(const char *p, const char *end, long &out) {
+        bool neg = false;
+        if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+        const char *start = p;
+        long v = 0;
+        while (p < end && *p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+        out = neg ? -v : v;
+        return p == start ? nullptr : p;
+    }
+
+    // the lowercase word s at p, in any case
+    static bool match_nocase(const char *p, const char *end, const char *s) {
+        for (; *s; ++p, ++s)
+            if (p >= end || (*p | 0x20) != *s) return false;
+        return true;
+    }
+
+    static const char *parse_float(const char *p, const char *end, float &out) {
+        static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                       1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+        p = skip_space(p, end);
+        bool neg = false;
+        if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+        // nan, inf and infinity in any case, like strtof
+        if (match_nocase(p, end, "nan")) {
+            out = neg ? -std::numeric_limits<float>::quiet_NaN() : std::numeric_limits<float>::quiet_NaN();
+            return p + 3;
+        }
+        if (match_nocase(p, end, "inf")) {
+            out = neg ? -std::numeric_limits<float>::infinity() : std::numeric_limits<float>::infinity();
+            return match_nocase(p, end, "infinity") ? p + 8 : p + 3;
+        }
+        const char *start = p;
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p)
+            if (digits < 19) mantissa = mantissa * 10 + (*p - '0'), digits += mantissa != 0;
+            else ++exponent;
+        if (p < end && *p == '.')
+            for (++p; p < end && *p >= '0' && *p <= '9'; ++p)
+                if (digits < 19) mantissa = mantissa * 10 + (*p - '0'), digits += mantissa != 0, --exponent;
+        if (p == start || (p == start + 1 && *start == '.')) return nullptr;
+        if (p < end && (*p == 'e' || *p == 'E')) {
+            long e;
+            const char *q = parse_int(p + 1, end, e);
+            if (!q) return nullptr;
+            exponent += static_cast<int>(std::max(-400L, std::min(400L, e)));
+            p = q;
+        }
+        double v = static_cast<double>(mantissa);
+        if (exponent < 0) v = -exponent <= 22 ? v / pow10[-exponent] : v * pow(10.0, exponent);
+        else if (exponent > 0) v = exponent <= 22 ? v * pow10[exponent] : v * pow(10.0, exponent);
+        out = static_cast<float>(neg ? -v : v);
+        return p;
+    }
+
+    // `v/vt/vn` corner; indices are resolved to be zero-based
+    static const char *parse_corner(const char *p, const char *end, const Counts &seen, const Counts &total,
+                                    int &v, int &vn) {
+        long i;
+        if (!(p = parse_int(p, end, i))) return nullptr;
+        i = i < 0 ? static_cast<long>(seen.positions) + i : i - 1;
+        if (i < 0 || i >= static_cast<long>(total.positions)) return nullptr;
+        v = static_cast<int>(i);
+        vn = -1;
+        if (p < end && *p == '/') {
+            ++p;
+            if (p < end && *p != '/' && !is_space(*p) && *p != '\n' && !(p = parse_int(p, end, i))) return nullptr;
+            if (p < end && *p == '/') {
+                if (!(p = parse_int(p + 1, end, i))) return nullptr;
+                i = i < 0 ? static_cast<long>(seen.normals) + i : i - 1;
+                if (i < 0 || i >= static_cast<long>(total.normals)) return nullptr;
+                vn = static_cast<int>(i);
+            }
+        }
+        return p;
+    }
+
+    bool parse(const char *p, const char *end, Counts seen, const Counts &total) {
+        while (p < end) {
+            p = skip_space(p, end);
+            switch (keyword(p, end)) {
+                case V: {
+                    float *out = &positions[seen.positions++ * 3];
+                    p += 1;
+                    for (int k = 0; k < 3; ++k)
+                        if (!(p = parse_float(p, end, out[k]))) return false;
+                    break;
+                }
+                case VN: {
+                    float *out = &normals[seen.normals++ * 3];
+                    p += 2;
+                    for (int k = 0; k < 3; ++k)
+                        if (!(p = parse_float(p, end, out[k]))) return false;
+                    break;
+                }
+                case F: {
+                    int first[2] = {0, -1}, prev[2] = {0, -1}, num_corner = 0;
+                    for (++p;; p = skip_token(p, end)) {
+                        p = skip_space(p, end);
+                        if (is_end(p, end)) break;
+                        if (!is_corner(p, end)) continue;
+                        int cur[2];
+                        if (!(p = parse_corner(p, end, seen, total, cur[0], cur[1]))) return false;
+                        if (num_corner == 0) first[0] = cur[0], first[1] = cur[1];
+                        if (num_corner >= 2) {
+                            int *out = &corners[seen.triangles++ * 6];
+                            out[0] = first[0], out[1] = first[1];
+                            out[2] = prev[0], out[3] = prev[1];
+                            out[4] = cur[0], out[5] = cur[1];
+                        }
+                        prev[0] = cur[0], prev[1] = cur[1];
+                        ++num_corner;
+                    }
+                    break;
+                }
+                default: break;
+            }
+            p = skip_line(p, end);
+        }
+        return true;
+    }
+};
@@ -1,54 +1,53 @@
 #pragma once
 #include <atomic>
 #include <chrono>
+#include <functional>
 #include <limits>
+#include <memory>
 #include <vector>
 #include <thread>
 #include <tuple>
+#include <type_traits>
 #include <cstdint>
 #include <cassert>
 #include <concurrentqueue.h>
 #include "geometry.hpp"
+#include "denoiser.hpp"
+#include "irradiance_cache.hpp"
+#include "wavefront.hpp"
 
 struct RayTracer {
-    struct TraceConfig {
-        float num_light_sample_per_unit = 1.0f;
-        int num_trace_depth = 3;
-        int num_diffuse_reflect_sample = 32;
-        int num_worker = 4;
-
-        TraceConfig() {}
-    };
+    typedef ::TraceConfig TraceConfig;
 
     Scene scene;
+    mutable IrradianceCache irradiance_cache;   // of the current render, with config.irradiance_cache_error > 0
+    std::vector<Color> radiance;    // of the last render, before clamping, with config.denoise_passes > 0
+    PrimaryHitCache primary_hits;   // of the last render, with config.primary_hit_cache
+    RenderStats::Counters stats;    // of the last render, with config.collect_stats
+    std::vector<float> cost;        // of every pixel of the last render's window, with config.cost_metric
+    double stats_seconds = 0;       // of tracing in the last render, without denoising
+    AuxBuffers aux;                 // of the last render, with config.denoise_passes > 0
     std::atomic<int> cnt_rendered;
+    std::atomic<int> cnt_total;     // pixels the render traces, those of the window in config.traces_pixel
     std::atomic<bool> flag_to_stop;
     std::atomic<bool> flag_stopped;
-    RayTracer(): scene() {}
+    RayTracer(): scene(), flag_to_stop(false), flag_stopped(false) {}
 
     FindNearestResult find_nearest(const Ray &ray) const {
-        FindNearestResult res;
-        // use kdtree:
-        for (const Primitive *pr : scene.primitives)
-            res.update(pr->intersect(ray), pr);
-        for (Body *body : scene.bodies)
-            res.update(body->kdtree.find_nearest(ray));
-//        // use brute force:
-//        for (const Primitive *pr : scene.primitives)
-//            res.update(pr->intersect(ray), pr);
-//        for (Body *body : scene.bodies)
-//            for (const Triangle *t : body->triangles)
-//                res.update(t->intersect(ray), t);
-        return res;
+        return scene.find_nearest(ray);
     }
 
     struct CalcShadeResult {
         float shade;
         Vector3 light_direction;
     };
-    float calc_shade_point_light(const Primitive *light, const Vector3 &light_diff, const Vector3& pi) const {
+    float calc_shade_point_light(const Primitive *light, int sample, const Vector3 &light_diff, const Vector3& pi,
+                                 const TraceConfig &config) const {
         Vector3 L = light_diff.normalized();
         Ray ray_shadow(pi + L * EPS, L);
+        RenderStats::count_ray(RenderStats::SHADOW);
+        RayCapture::record_shadow(ray_shadow, pi + light_diff);
+        if (config.shadow_cache) return ShadowCache::visible(scene, ray_shadow, light, sample) ? 1.f : .0f;
         FindNearestResult r = find_nearest(ray_shadow);
         return r.primitive == light ? 1.f : .0f;
     }
@@ -56,18 +55,20 @@ struct RayTracer {
         if (light->type == Primitive::SPHERE) {
             const Sphere *ls = static_cast<const Sphere *>(light);
             Vector3 light_diff = ls->center - pi;
-            float shade = calc_shade_point_light(ls, light_diff, pi);
+            RenderStats::count_light_samples(1);
+            float shade = calc_shade_point_light(ls, 0, light_diff, pi, config);
             return {.shade = shade, .light_direction = light_diff.normalized()};
         } else if (light->type == Primitive::BOX) {
             const Box *lb = static_cast<const Box*>(light);
             Vector3 L(0, 0, 0);
             float shade = .0;
             const int n = lb->get_num_light_sample(config.num_light_sample_per_unit);
+            RenderStats::count_light_samples(n);
             for (int i = 0; i < n; ++i) {
                 const Vector3 &light_point = lb->light_samples[i];
                 Vector3 light_diff = light_point - pi;
                 L += light_diff.normalized();
-                shade += calc_shade_point_light(lb, light_diff, pi);
+                shade += calc_shade_point_light(lb, i, light_diff, pi, config);
             }
             return {.shade = shade / n, .light_direction = L / n};
         }
@@ -80,12 +81,22 @@ struct RayTracer {
         Color color;
         const Primitive *primitive;
     };
-    RayTraceResult ray_trace(const Ray& ray, float refract_index, int depth, const TraceConfig &config) const {
-        RayTraceResult res = {.hit = false, .distance = 0, .color = Color(0, 0, 0), .primitive = nullptr};
-        if (depth > config.num_trace_depth) return res;
+    RayTraceResult ray_trace(const Ray& ray, float refract_index, int depth, const TraceConfig &config,
+                             RenderStats::RayType type = RenderStats::PRIMARY) const {
+        if (depth > config.num_trace_depth)
+            return {.hit = false, .distance = 0, .color = Color(0, 0, 0), .primitive = nullptr};
+        RenderStats::count_ray(type);
+        RayCapture::record(ray, type);
 
         // find the nearest intersection
-        FindNearestResult res_nearest = find_nearest(ray);
+        return shade_hit(ray, find_nearest(ray), refract_index, depth, config);
+    }
+
+    // ray_trace of a ray whose nearest intersection is known already
+    RayTraceResult shade_hit(const Ray& ray, const FindNearestResult &res_nearest, float refract_index, int depth,
+                             const TraceConfig &config) const {
+        RayTraceResult res = {.hit = false, .distance = 0, .color = Color(0, 0, 0), .primitive = nullptr};
+        if (depth > config.num_trace_depth) return res;
         if (res_nearest.hit == IntersectionResult::MISS) return res;
         res.hit = true;
         res.primitive = res_nearest.primitive;
@@ -96,52 +107,112 @@ struct RayTracer {
             return {.hit = true, .distance = res.distance, .color = res.primitive->material.color, .primitive = res.primitive};
 
         // if normal object
+        (this->*shade_kernel(res.primitive->material.features))(ray, res_nearest, refract_index, depth, config, res);
+        return res;
+    }
+
+private:
+    typedef void (RayTracer::*ShadeKernel)(const Ray &, const FindNearestResult &, float, int, const TraceConfig &,
+                                           RayTraceResult &) const;
+
+    static ShadeKernel shade_kernel(uint32_t features) {
+        static const std::vector<ShadeKernel> table = [] {
+            std::vector<ShadeKernel> t(Material::NUM_FEATURE_MASKS);
+            fill_shade_kernels(t.data());
+            return t;
+        }();
+        return table[features];
+    }
+
+    template <uint32_t Features = 0>
+    static typename std::enable_if<(Features < Material::NUM_FEATURE_MASKS)>::type fill_shade_kernels(ShadeKernel *t) {
+        t[Features] = &RayTracer::shade<Features>;
+        fill_shade_kernels<Features + 1>(t);
+    }
+
+    template <uint32_t Features>
+    static typename std::enable_if<(Features == Material::NUM_FEATURE_MASKS)>::type fill_shade_kernels(ShadeKernel *) {}
+
+    // shading of a hit on a material with the given Material::Feature mask; the branches on
+    // Features are resolved at compile time, so every kernel only has the code its materials need
+    template <uint32_t Features>
+    void shade(const Ray &ray, const FindNearestResult &res_nearest, float refract_index, int depth,
+               const TraceConfig &config, RayTraceResult &res) const {
+        const Material &material = res.primitive->material;
         Vector3 pi = ray.origin + ray.direction * res.distance; // intersection point
         Vector3 N = res.primitive->get_normal(pi);
-        Color color_pi = res.primitive->get_color(pi);
-        for (const Primitive *light : scene.lights) {
-            // shadow
-            CalcShadeResult res_shade = calc_shade(light, pi, config);
-            Vector3 L = res_shade.light_direction;
-            float shade = res_shade.shade;
-
-            if (shade > 0) {
-                // diffuse shading
-                float k_diffuse = res.primitive->material.k_diffuse;
-                if (k_diffuse > 0) {
-                    float dot = N.dot(L);
-                    if (dot > 0)
-                        res.color += dot * k_diffuse * shade * color_pi * light->material.color;
-                }
+        // the cone hits the surface at a slant; the secondary rays start out as wide as the cone here
+        const float cone_width = ray.cone_width_at(res.distance);
+        Color color_pi = material.color;
+        if (Features & Material::TEXTURED) {
+            const float footprint = cone_width / std::max(fabsf(N.dot(ray.direction)), 1e-2f);
+            color_pi = res.primitive->get_color(pi, footprint);
+        }
+        if (Features & (Material::DIFFUSE | Material::SPECULAR)) {
+            // weight: of the light's contribution, 1 / (number of picks * pdf) for picked lights
+            auto shade_light = [&](const Primitive *light, float weight) {
+                // shadow
+                CalcShadeResult res_shade = calc_shade(light, pi, config);
+                Vector3 L = res_shade.light_direction;
+                float shade = res_shade.shade * weight;
+
+                if (shade > 0) {
+                    // diffuse shading
+                    if (Features & Material::DIFFUSE) {
+                        float dot = N.dot(L);
+                        if (dot > 0)
+                            res.color += dot * material.k_diffuse * shade * color_pi * light->material.color;
+                    }
 
-                // specular shading
-                float k_specular = res.primitive->material.k_specular;
-                if (k_specular > 0) {
-                    Vector3 R = L - 2.f * L.dot(N) * N;
-                    float dot = ray.direction.dot(R);
-                    if (dot > 0)
-                        res.color += powf(dot, 20) * k_specular * shade * light->material.color;
+                    // specular shading
+                    if (Features & Material::SPECULAR) {
+                        Vector3 R = L - 2.f * L.dot(N) * N;
+                        float dot = ray.direction.dot(R);
+                        if (dot > 0)
+                            res.color += powf(dot, 20) * material.k_specular * shade * light->material.color;
+                    }
+                }
+            };
+            const int num_pick = config.num_light_pick;
+            if (num_pick > 0 && static_cast<size_t>(num_pick) < scene.lights.size()) {
+                const Vector3 R = ray.direction - 2.f * ray.direction.dot(N) * N;
+                for (int k = 0; k < num_pick; ++k) {
+                    float pdf;
+                    const Primitive *light = scene.light_tree.sample(pi, N, (Features & Material::SPECULAR) ? &R : nullptr,
+                                                                     randf(), pdf);
+                    if (light) shade_light(light, 1.f / (num_pick * pdf));
                 }
+            } else {
+                for (const Primitive *light : scene.lights) shade_light(light, 1.f);
             }
         }
 
         // reflection
-        float k_reflect = res.primitive->material.k_reflect;
-        if (k_reflect > 0) {
-            float k_diffuse_reflect = res.primitive->material.k_diffuse_reflect;
-            if (k_diffuse_reflect > 0 && depth <= 1) {
+        if (Features & Material::REFLECT) {
+            float k_reflect = material.k_reflect;
+            if ((Features & Material::DIFFUSE_REFLECT) && depth <= 1 && config.irradiance_cache_error > 0) {
+                // diffuse reflection: interpolated from the irradiance cache, or sampled into it
+                Color E;
+                if (!irradiance_cache.lookup(pi, N, E)) {
+                    IrradianceCache::Samples samples(N, config.num_diffuse_reflect_sample);
+                    TraceConfig config_importance = config;
+                    config_importance.num_light_sample_per_unit *= 0.25;
+                    for (size_t i = 0; i < samples.directions.size(); ++i) {
+                        const Vector3 &R = samples.directions[i];
+                        Ray ray_reflect(pi + R * EPS, R, cone_width, ray.cone_spread);
+                        RayTraceResult r = ray_trace(ray_reflect, refract_index, depth + 1, config_importance,
+                                                     RenderStats::DIFFUSE);
+                        if (r.hit) samples.radiance[i] = r.color, samples.distance[i] = r.distance;
+                    }
+                    E = irradiance_cache.insert(pi, N, cone_width, samples);
+                }
+                res.color += k_reflect * E * color_pi;
+            } else if ((Features & Material::DIFFUSE_REFLECT) && depth <= 1) {
                 // diffuse reflection: only primary ray
-                Vector3 RP = ray.direction - 2.f * ray.direction.dot(N) * N;
-                Vector3 RN1 = Vector3(RP.z, RP.y, -RP.x);
-                Vector3 RN2 = RP.cross(RN1);
                 Color c(0, 0, 0);
                 TraceConfig config_importance = config;
                 config_importance.num_light_sample_per_unit *= 0.25;
                 for (int i = 0; i < config.num_diffuse_reflect_sample; ++i) {
-//                    float len = randf() * k_diffuse_reflect;
-//                    float angle = static_cast<float>(randf() * 2 * M_PI);
-//                    float xoff = len * cosf(angle), yoff = len * sinf(angle);
-//                    Vector3 R = (RP + RN1 * xoff + RN2 * yoff * k_diffuse_reflect).normalized();
                     Vector3 Nx, Nz, Ny = N;
                     if (fabsf(Ny.x) > fabs(Ny.y)) Nx = Vector3(Ny.z, 0, -Ny.x);
                     else Nx = Vector3(0, -Ny.z, Ny.y);
@@ -153,8 +224,9 @@ struct RayTracer {
                             sample.x * Nx.y + sample.y * Ny.y + sample.z * Nz.y,
                             sample.x * Nx.z + sample.y * Ny.z + sample.z * Nz.z
                     );
-                    Ray ray_reflect(pi + R * EPS, R);
-                    RayTraceResult r = ray_trace(ray_reflect, refract_index, depth + 1, config_importance);
+                    Ray ray_reflect(pi + R * EPS, R, cone_width, ray.cone_spread);
+                    RayTraceResult r = ray_trace(ray_reflect, refract_index, depth + 1, config_importance,
+                                                 RenderStats::DIFFUSE);
                     if (r.hit)
                         c += k_reflect * r.color * color_pi;
                 }
@@ -162,29 +234,30 @@ struct RayTracer {
             } else {
                 // perfect reflection
                 Vector3 R = ray.direction - 2.f * ray.direction.dot(N) * N;
-                Ray ray_reflect(pi + R * EPS, R);
+                Ray ray_reflect(pi + R * EPS, R, cone_width, ray.cone_spread);
                 TraceConfig config_importance = config;
                 config_importance.num_light_sample_per_unit *= 0.5;
-                RayTraceResult r = ray_trace(ray_reflect, refract_index, depth + 1, config_importance);
+                RayTraceResult r = ray_trace(ray_reflect, refract_index, depth + 1, config_importance,
+                                             RenderStats::REFLECTION);
                 if (r.hit)
                     res.color += k_reflect * r.color * color_pi;
             }
         }
 
         // refraction
-        float k_refract = res.primitive->material.k_refract;
-        if (k_refract > 0) {
-            float k_refract_index = res.primitive->material.k_refract_index;
+        if (Features & Material::REFRACT) {
+            float k_refract_index = material.k_refract_index;
             float n = refract_index / k_refract_index;
             Vector3 Nd = res_nearest.hit == IntersectionResult::INSIDE ? -N : N;
             float cosI = -Nd.dot(ray.direction);
             float cosT2 = 1.f - n * n * (1.f - cosI * cosI);
             if (cosT2 > 0) {
                 Vector3 T = n * ray.direction + (n * cosI - sqrtf(cosT2)) * Nd;
-                Ray ray_refract(pi + T * EPS, T);
+                Ray ray_refract(pi + T * EPS, T, cone_width, ray.cone_spread);
                 TraceConfig config_importance = config;
                 config_importance.num_light_sample_per_unit *= 0.5;
-                RayTraceResult r = ray_trace(ray_refract, k_refract_index, depth + 1, config_importance);
+                RayTraceResult r = ray_trace(ray_refract, k_refract_index, depth + 1, config_importance,
+                                             RenderStats::REFRACTION);
                 if (r.hit) {
 //                    Color absorb = color_pi * 0.15f * -r.distance;
 //                    Color transparency = expf(absorb);
@@ -193,63 +266,160 @@ struct RayTracer {
                 }
             }
         }
+    }
 
-        return res;
+public:
+    struct Tile {
+        int x0, y0, x1, y1;
+    };
+    static constexpr int TILE_SIZE = 16;
+
+    // pixel rectangle [x0, x1) x [y0, y1) of the frame
+    typedef Tile Window;
+
+    // If set, render calls it from the workers with every tile of out as soon as it is written, in
+    // coordinates relative to the window, or once with the whole window when it is denoised.
+    // Viewers use it to refresh only the pixels that changed.
+    std::function<void(const Tile &)> on_tile;
+
+    bool render(uint8_t *out, int width, int height, const TraceConfig &config,
+                const std::function<void(int, int)> &on_rows = nullptr) {
+        return render(out, width, width, height, {0, 0, width, height}, config, on_rows);
     }
 
-    // TODO: camera position, scre  en position, z direction
-    bool render(uint8_t *out, int width, int height, const TraceConfig &config) {
-        flag_to_stop = false;
+    // Traces the pixels of window in a width x height frame. out holds the window, starting at its
+    // top left pixel, with rows out_stride pixels apart: a cropped image, or the matching area of
+    // a frame sized image. Rows passed to on_rows count from the top of the window.
+    // Work is handed out in TILE_SIZE x TILE_SIZE tiles. Without on_rows they come in random order;
+    // with it they come band by band, and on_rows(y0, y1) is called on this thread, in order,
+    // as soon as all tiles of rows [y0, y1) are finished. With config.denoise_passes, the tiles
+    // go to radiance and aux (sized as the window) instead, and out is written and handed to
+    // on_rows once the whole window is denoised. A stop() made before the render starts is kept, so
+    // that it returns false right away; the caller clears flag_to_stop for the next render.
+    bool render(uint8_t *out, int out_stride, int width, int height, Window window, const TraceConfig &config,
+                const std::function<void(int, int)> &on_rows = nullptr) {
         flag_stopped = false;
         cnt_rendered = 0;
+        window.x0 = std::max(window.x0, 0), window.y0 = std::max(window.y0, 0);
+        window.x1 = std::min(window.x1, width), window.y1 = std::min(window.y1, height);
+        const int window_width = std::max(0, window.x1 - window.x0), window_height = std::max(0, window.y1 - window.y0);
+        int total = 0;
+        for (int y = window.y0; y < window.y1; ++y)
+            for (int x = window.x0; x < window.x1; ++x) total += config.traces_pixel(x, y);
+        cnt_total = total;
 
+        scene.prepare();
+        irradiance_cache.reset(config.irradiance_cache_error);
+        ShadowCache::reset_totals();
+        RenderStats::reset_totals();
         for (Primitive *light : scene.lights)
             light->sample_light(config.num_light_sample_per_unit);
 
-        float wx1 = -4, wx2 = 4, wy1 = 3, wy2 = -3;
-        float dx = (wx2 - wx1) / width;
-        float dy = (wy2 - wy1) / height;
-        Vector3 o(0, 0, -6);
+        const Camera::Screen screen = scene.camera.get_screen(width, height);
+        const bool denoise = config.denoise_passes > 0;
+        // primary hits are either all reused or all traced and kept; a progressive pass adds to the
+        // hits of the passes before it, and the last one (pixel_step 1) makes them valid
+        const bool reuse_hits = config.primary_hit_cache &&
+                primary_hits.matches(window.x0, window.y0, window_width, window_height, width, height, screen);
+        if (config.primary_hit_cache && !reuse_hits &&
+            !(config.skip_coarser_pixels &&
+              primary_hits.same_window(window.x0, window.y0, window_width, window_height, width, height, screen)))
+            primary_hits.reset(window.x0, window.y0, window_width, window_height, width, height, screen);
+        PrimaryHitCache *const hit_cache = config.primary_hit_cache ? &primary_hits : nullptr;
+        if (denoise) {
+            radiance.assign(static_cast<size_t>(window_width) * window_height, Color(0, 0, 0));
+            aux.resize(window_width, window_height);
+        }
+        const bool measure_cost = config.cost_metric != TraceConfig::COST_NONE;
+        if (measure_cost) cost.assign(static_cast<size_t>(window_width) * window_height, 0.f);
 
-        moodycamel::ConcurrentQueue<std::pair<int, int>> q;
+        const int num_band = (window_height + TILE_SIZE - 1) / TILE_SIZE;
+        const int num_tile_per_band = (window_width + TILE_SIZE - 1) / TILE_SIZE;
+        std::unique_ptr<std::atomic<int>[]> cnt_band_tile_left(new std::atomic<int>[num_band]);
+        for (int i = 0; i < num_band; ++i) cnt_band_tile_left[i] = num_tile_per_band;
+
+        moodycamel::ConcurrentQueue<Tile> q;
         auto func = [&] {
-            for (std::pair<int, int> item; q.try_dequeue(item);) {
-                const int x = item.first, y = item.second;
-                const float sy = wy1 + dy * y;
-                const float sx = wx1 + dx * x;
-                Ray ray(o, Vector3(sx, sy, -2) - o);
-                RayTraceResult res = ray_trace(ray, 1.f, 1, config);
-                Color color = res.hit ? res.color : Color(0, 0, 0);
-                const int idx = (y * width + x) * 3;
-                color_save_to_array(&out[idx], res.color);
-                ++cnt_rendered;
+            RenderStats::enabled() = config.counts_work();
+            std::unique_ptr<WavefrontIntegrator> wavefront;
+            if (config.wavefront) wavefront.reset(new WavefrontIntegrator(scene, config));
+            for (Tile tile; q.try_dequeue(tile);) {
+                if (wavefront) {
+                    cnt_rendered += wavefront->render_tile(screen, tile.x0, tile.y0, tile.x1, tile.y1, out, out_stride,
+                                                           window.x0, window.y0, denoise ? radiance.data() : nullptr,
+                                                           denoise ? &aux : nullptr, hit_cache,
+                                                           measure_cost ? cost.data() : nullptr, window_width);
+                } else {
+                    for (int y = tile.y0; y < tile.y1; ++y) {
+                        for (int x = tile.x0; x < tile.x1; ++x) {
+                            if (!config.traces_pixel(x, y)) continue;
+                            const uint64_t cost_start = measure_cost ? cost_counter(config) : 0;
+                            const Ray ray = screen.ray(x, y);
+                            RayTraceResult res;
+                            if (hit_cache) {
+                                FindNearestResult &hit = hit_cache->at(x, y);
+                                if (!reuse_hits) {
+                                    hit = find_nearest(ray);
+                                    RenderStats::count_ray(RenderStats::PRIMARY);
+                                    RayCapture::record(ray, RenderStats::PRIMARY);
+                                }
+                                res = shade_hit(ray, hit, 1.f, 1, config);
+                            } else {
+                                res = ray_trace(ray, 1.f, 1, config);
+                            }
+                            if (measure_cost)
+                                cost[static_cast<size_t>(y - window.y0) * window_width + (x - window.x0)] =
+                                        static_cast<float>(cost_counter(config) - cost_start);
+                            if (denoise) {
+                                const size_t idx = static_cast<size_t>(y - window.y0) * window_width + (x - window.x0);
+                                radiance[idx] = res.color;
+                                aux.set(idx, scene, ray, res.primitive, res.distance);
+                            } else {
+                                const size_t idx = static_cast<size_t>(y - window.y0) * out_stride + (x - window.x0);
+                                color_save_to_array(&out[idx * 3], res.color);
+                            }
+                            ++cnt_rendered;
+                        }
+                    }
+                }
+                if (on_tile && !denoise)
+                    on_tile({tile.x0 - window.x0, tile.y0 - window.y0, tile.x1 - window.x0, tile.y1 - window.y0});
+                --cnt_band_tile_left[(tile.y0 - window.y0) / TILE_SIZE];
             }
+            ShadowCache::flush();
+            RenderStats::flush();
+            RayCapture::flush();
         };
 
         auto start = std::chrono::high_resolution_clock::now();
-        std::vector<std::pair<int, int>> xys;
-//        xys.emplace_back(157, 435);
-        for (int y = 0; y < height; ++y)
-            for (int x = 0; x < width; ++x)
-                xys.emplace_back(x, y);
-        std::random_shuffle(xys.begin(), xys.end());
-        for (const auto &xy : xys) q.enqueue(xy);
+        std::vector<Tile> tiles;
+        for (int y = window.y0; y < window.y1; y += TILE_SIZE)
+            for (int x = window.x0; x < window.x1; x += TILE_SIZE)
+                tiles.push_back({x, y, std::min(x + TILE_SIZE, window.x1), std::min(y + TILE_SIZE, window.y1)});
+        if (!on_rows) std::random_shuffle(tiles.begin(), tiles.end());
+        q.enqueue_bulk(tiles.begin(), tiles.size());
+
+        int cnt_band_flushed = 0;
+        auto flush_rows = [&] {
+            for (; on_rows && cnt_band_flushed < num_band && cnt_band_tile_left[cnt_band_flushed] == 0; ++cnt_band_flushed)
+                on_rows(cnt_band_flushed * TILE_SIZE, std::min(window_height, (cnt_band_flushed + 1) * TILE_SIZE));
+        };
 
         std::vector<std::thread> workers;
         for (int i = 0; i < config.num_worker; ++i) workers.emplace_back(func);
-        const int total = width * height;
         for (;;) {
             int cnt = cnt_rendered.load();
             auto now = std::chrono::high_resolution_clock::now();
             auto sec = (now - start).count() / 1e9;
             fprintf(stderr, "\rrendered %d/%d pixels using %d workers in %.3fs...", cnt, total, config.num_worker, sec);
             if (cnt == total) break;
+            if (!denoise) flush_rows();
             std::this_thread::sleep_for(std::chrono::milliseconds(25));
 
             // if force stop
             if (flag_to_stop) {
                 fprintf(stderr, "got stop flag..."); fflush(stderr);
-                std::pair<int, int> ignore;
+                Tile ignore;
                 while (q.try_dequeue(ignore));
                 for (auto &worker : workers) worker.join();
                 fprintf(stderr, "stopped\n");
@@ -259,6 +429,32 @@ struct RayTracer {
         }
         for (auto &worker : workers) worker.join();
         fprintf(stderr, "done\n");
+        stats = RenderStats::totals();
+        stats_seconds = (std::chrono::high_resolution_clock::now() - start).count() / 1e9;
+        if (hit_cache) {
+            if (reuse_hits) fprintf(stderr, "shaded the primary hits of the last render again\n");
+            else if (config.pixel_step == 1) primary_hits.valid = true;
+        }
+        if (denoise) {
+            auto denoise_start = std::chrono::high_resolution_clock::now();
+            Denoiser().denoise(radiance, aux, config.denoise_passes, config.num_worker);
+            for (int y = 0; y < window_height; ++y)
+                for (int x = 0; x < window_width; ++x)
+                    color_save_to_array(&out[(static_cast<size_t>(y) * out_stride + x) * 3],
+                                        radiance[static_cast<size_t>(y) * window_width + x]);
+            if (on_tile) on_tile({0, 0, window_width, window_height});
+            auto sec = (std::chrono::high_resolution_clock::now() - denoise_start).count() / 1e9;
+            fprintf(stderr, "denoised with %d passes in %.3fs\n", config.denoise_passes, sec);
+        }
+        flush_rows();
+        const ShadowCache::Stats shadow = ShadowCache::totals();
+        if (config.collect_stats && shadow.num_ray)
+            fprintf(stderr, "shadow rays: %llu, %llu blocked, of which %llu (%.1f%%) by the cached occluder "
+                            "(%llu tested) without traversal\n",
+                    static_cast<unsigned long long>(shadow.num_ray), static_cast<unsigned long long>(shadow.num_blocked),
+                    static_cast<unsigned long long>(shadow.num_hit),
+                    shadow.num_blocked ? 100. * shadow.num_hit / shadow.num_blocked : 0.,
+                    static_cast<unsigned long long>(shadow.num_test));
         flag_stopped = true;
         return true;
     }
@@ -0,0 +1,236 @@
+#include <string>
+#include <fstream>
+#include "raytracer.hpp"
+
+// Fires the rays of a capture (raytracer-cli -a) at an intersection kernel of the scene they were
+// captured in, and reports the throughput of every kind of ray. The hits can be written out, and
+// checked against those of another run, so that a traversal change is timed and verified on the
+// rays of a real render in seconds.
+
+void help() {
+    fputs("usage: ./raytracer-replay [options]\n", stderr);
+    fputs("options:\n", stderr);
+    fputs("   -f <STRING>     path to the scene json the rays were captured in\n", stderr);
+    fputs("   -a <STRING>     path to the ray capture, from raytracer-cli -a\n", stderr);
+    fputs("   -k <STRING>     intersection kernel: kdtree (default), packet (four rays of a kind at a time through the k-d trees) or brute (every primitive and triangle, slow)\n", stderr);
+    fputs("   -j <INT>        number of threads, default 1\n", stderr);
+    fputs("   -i <INT>        iterations, of which the fastest counts, default 3\n", stderr);
+    fputs("   -o <STRING>     write the hits to this file\n", stderr);
+    fputs("   -e <STRING>     check the hits against this file, written by -o of another run\n", stderr);
+    exit(EXIT_FAILURE);
+}
+
+// what a ray hit, comparable across runs: the object (Scene::object_id), the triangle within its
+// body, and the distance
+struct Hit {
+    uint32_t object;
+    uint32_t triangle;
+    float distance;
+};
+
+Hit identify(const Scene &scene, const FindNearestResult &res) {
+    Hit hit = {0, 0, std::numeric_limits<float>::infinity()};
+    if (res.hit == IntersectionResult::MISS) return hit;
+    hit.object = scene.object_id(res.primitive);
+    hit.distance = res.distance;
+    if (res.primitive->type == Primitive::TRIANGLE && hit.object > scene.primitives.size()) {
+        const std::vector<Triangle> &t = scene.bodies[hit.object - scene.primitives.size() - 1]->triangles;
+        hit.triangle = static_cast<uint32_t>(static_cast<const Triangle *>(res.primitive) - t.data());
+    }
+    return hit;
+}
+
+// every primitive and every triangle, as a reference for the k-d tree
+FindNearestResult find_nearest_brute(const Scene &scene, const Ray &ray) {
+    FindNearestResult res;
+    for (const Primitive *pr : scene.primitives)
+        res.update(pr->intersect(ray), pr);
+    for (const Body *body : scene.bodies)
+        for (const Triangle &t : body->triangles)
+            res.update(t.intersect(ray), &t);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    const char *filename = nullptr, *capture = nullptr, *out = nullptr, *expected = nullptr;
+    std::string kernel = "kdtree";
+    int num_thread = 1, num_iteration = 3;
+
+    if (argc == 1 || argc % 2 != 1) help();
+    for (int i = 1; i < argc; i += 2) {
+        std::string key = argv[i];
+        const char *value = argv[i+1];
+        if (key == "-f") {
+            filename = value;
+        } else if (key == "-a") {
+            capture = value;
+        } else if (key == "-k") {
+            kernel = value;
+            if (kernel != "kdtree" && kernel != "packet" && kernel != "brute") {
+                fprintf(stderr, "unknown kernel %s\n", value);
+                help();
+            }
+        } else if (key == "-j") {
+            num_thread = std::max(1, std::atoi(value));
+        } else if (key == "-i") {
+            num_iteration = std::max(1, std::atoi(value));
+        } else if (key == "-o") {
+            out = value;
+        } else if (key == "-e") {
+            expected = value;
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            help();
+        }
+    }
+    if (!filename || !capture) help();
+
+    Scene scene;
+    std::ifstream fin(filename);
+    json j;
+    fin >> j;
+    scene.from_json(j);
+    scene.prepare();
+    uint64_t num_triangle = 0;
+    for (const Body *body : scene.bodies) num_triangle += body->triangles.size();
+
+    MappedFile file;
+    const RayCapture::Header *header;
+    size_t num_ray = 0;
+    const RayCapture::Record *records = file.open(capture) ? RayCapture::records(file, header, num_ray) : nullptr;
+    if (!records) {
+        fprintf(stderr, "failed to read ray capture: %s\n", capture);
+        return EXIT_FAILURE;
+    }
+    if (header->num_primitives != scene.primitives.size() || header->num_triangles != num_triangle) {
+        fprintf(stderr, "the rays were captured in a scene of %llu primitives and %llu triangles, not this one\n",
+                static_cast<unsigned long long>(header->num_primitives),
+                static_cast<unsigned long long>(header->num_triangles));
+        return EXIT_FAILURE;
+    }
+
+    // rays of a kind are traced together, in the order they were captured
+    std::vector<Ray> rays[RenderStats::NUM_RAY_TYPES];
+    std::vector<size_t> index[RenderStats::NUM_RAY_TYPES];
+    for (size_t i = 0; i < num_ray; ++i) {
+        const RayCapture::Record &r = records[i];
+        if (r.type >= RenderStats::NUM_RAY_TYPES) {
+            fprintf(stderr, "ray %zu of the capture has an unknown type %u\n", i, r.type);
+            return EXIT_FAILURE;
+        }
+        // as captured, without normalizing the direction again
+        const Vector3 direction(r.direction[0], r.direction[1], r.direction[2]);
+        Ray ray(Vector3(r.origin[0], r.origin[1], r.origin[2]), direction);
+        ray.direction = direction;
+        rays[r.type].push_back(ray);
+        index[r.type].push_back(i);
+    }
+
+    printf("========== ray capture ==========\n");
+    printf("                primitives    %zu\n", scene.primitives.size());
+    printf("                 triangles    %llu\n", static_cast<unsigned long long>(num_triangle));
+    printf("                      rays    %zu\n", num_ray);
+    printf("                    kernel    %s\n", kernel.c_str());
+    const bool brute = kernel == "brute", packet = kernel == "packet";
+    printf("                   threads    %d\n", num_thread);
+
+    // rays [0, n) go to the threads in blocks
+    std::vector<FindNearestResult> hits(num_ray);
+    // with count, every thread counts its traversal steps in RenderStats
+    auto trace = [&](const std::vector<Ray> &r, const std::vector<size_t> &idx, bool count) {
+        const size_t n = r.size(), block = 256;
+        std::atomic<size_t> next(0);
+        auto func = [&] {
+            RenderStats::enabled() = count;
+            for (size_t begin; (begin = next.fetch_add(block)) < n;) {
+                const size_t end = std::min(begin + block, n);
+                if (packet) {
+                    for (size_t k = begin; k < end; k += 4) {
+                        const int m = static_cast<int>(std::min<size_t>(4, end - k));
+                        const Ray *packet_rays[4];
+                        FindNearestResult res[4];
+                        for (int lane = 0; lane < m; ++lane) packet_rays[lane] = &r[k + lane];
+                        scene.find_nearest4(packet_rays, m, res);
+                        for (int lane = 0; lane < m; ++lane) hits[idx[k + lane]] = res[lane];
+                    }
+                    continue;
+                }
+                for (size_t k = begin; k < end; ++k)
+                    hits[idx[k]] = brute ? find_nearest_brute(scene, r[k]) : scene.find_nearest(r[k]);
+            }
+            RenderStats::flush();
+        };
+        std::vector<std::thread> threads;
+        for (int t = 1; t < num_thread; ++t) threads.emplace_back(func);
+        func();
+        for (auto &t : threads) t.join();
+    };
+
+    printf("=========== throughput ===========\n");
+    double total_seconds = 0;
+    for (int type = 0; type < RenderStats::NUM_RAY_TYPES; ++type) {
+        if (rays[type].empty()) continue;
+        const char *name = RenderStats::name(static_cast<RenderStats::RayType>(type));
+        double best = std::numeric_limits<double>::infinity();
+        for (int it = 0; it < num_iteration; ++it) {
+            auto start = std::chrono::high_resolution_clock::now();
+            trace(rays[type], index[type], false);
+            best = std::min(best, (std::chrono::high_resolution_clock::now() - start).count() / 1e9);
+        }
+        // once more, counting the traversal steps
+        RenderStats::reset_totals();
+        trace(rays[type], index[type], true);
+        const RenderStats::Counters c = RenderStats::totals();
+
+        size_t num_hit = 0, num_blocked = 0;
+        for (size_t i : index[type]) {
+            if (hits[i].hit == IntersectionResult::MISS) continue;
+            ++num_hit;
+            if (!hits[i].primitive->light && hits[i].distance < records[i].tmax) ++num_blocked;
+        }
+        const double n = static_cast<double>(rays[type].size());
+        printf("%21s rays    %zu in %.3fs (%.2f Mrays/s), %zu hit", name, rays[type].size(), best,
+               best > 0 ? n / best / 1e6 : 0., num_hit);
+        if (type == RenderStats::SHADOW) printf(", %zu before the light", num_blocked);
+        if (!brute) printf(", %.1f k-d nodes and %.1f triangles per ray", c.kd_nodes / n, c.triangle_tests / n);
+        printf("\n");
+        total_seconds += best;
+    }
+    printf("%26s    %zu in %.3fs (%.2f Mrays/s)\n", "all rays", num_ray, total_seconds,
+           total_seconds > 0 ? num_ray / total_seconds / 1e6 : 0.);
+
+    std::vector<Hit> result(num_ray);
+    for (size_t i = 0; i < num_ray; ++i) result[i] = identify(scene, hits[i]);
+    if (out) {
+        FILE *f = fopen(out, "wb");
+        const bool ok = f && fwrite(result.data(), sizeof(Hit), num_ray, f) == num_ray;
+        if (!(f && fclose(f) == 0 && ok)) fprintf(stderr, "failed to write hits to: %s\n", out);
+    }
+    if (expected) {
+        MappedFile ref;
+        if (!ref.open(expected) || ref.size != num_ray * sizeof(Hit)) {
+            fprintf(stderr, "failed to read %zu hits from: %s\n", num_ray, expected);
+            return EXIT_FAILURE;
+        }
+        // the same object and triangle, at the same distance up to rounding
+        const Hit *want = reinterpret_cast<const Hit *>(ref.data);
+        size_t num_mismatch[RenderStats::NUM_RAY_TYPES] = {}, total = 0;
+        for (size_t i = 0; i < num_ray; ++i) {
+            const Hit &a = result[i], &b = want[i];
+            const bool same = a.object == b.object && a.triangle == b.triangle &&
+                              (a.object == 0 || fabsf(a.distance - b.distance) <= 1e-4f * std::max(1.f, b.distance));
+            if (same) continue;
+            ++num_mismatch[records[i].type];
+            if (total++ < 10)
+                fprintf(stderr, "ray %zu (%s): object %u triangle %u at %g, expected object %u triangle %u at %g\n", i,
+                        RenderStats::name(static_cast<RenderStats::RayType>(records[i].type)),
+                        a.object, a.triangle, a.distance, b.object, b.triangle, b.distance);
+        }
+        printf("=========== check against %s ===========\n", expected);
+        for (int type = 0; type < RenderStats::NUM_RAY_TYPES; ++type)
+            if (!rays[type].empty())
+                printf("%21s rays    %zu of %zu differ\n", RenderStats::name(static_cast<RenderStats::RayType>(type)),
+                       num_mismatch[type], rays[type].size());
+        if (total) return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,277 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define RAYTRACER_SSE 1
+#endif
+
+// 4-wide float lanes on SSE, with a plain array fallback elsewhere. Comparisons give a mask4
+// that is used with select/any/all instead of branches, so that a kernel written over float4
+// and Vec3xN runs the same on every lane and simply ignores the lanes it masked off.
+
+struct mask4 {
+#ifdef RAYTRACER_SSE
+    __m128 v;
+
+    mask4() : v(_mm_setzero_ps()) {}
+
+    explicit mask4(__m128 v_) : v(v_) {}
+
+    friend mask4 operator&(mask4 a, mask4 b) { return mask4(_mm_and_ps(a.v, b.v)); }
+
+    friend mask4 operator|(mask4 a, mask4 b) { return mask4(_mm_or_ps(a.v, b.v)); }
+
+    friend mask4 andnot(mask4 a, mask4 b) { return mask4(_mm_andnot_ps(b.v, a.v)); }  // a & ~b
+
+    int bits() const { return _mm_movemask_ps(v); }
+#else
+    uint32_t v[4];
+
+    mask4() : v() {}
+
+    friend mask4 operator&(mask4 a, mask4 b) {
+        for (int i = 0; i < 4; ++i) a.v[i] &= b.v[i];
+        return a;
+    }
+
+    friend mask4 operator|(mask4 a, mask4 b) {
+        for (int i = 0; i < 4; ++i) a.v[i] |= b.v[i];
+        return a;
+    }
+
+    friend mask4 andnot(mask4 a, mask4 b) {
+        for (int i = 0; i < 4; ++i) a.v[i] &= ~b.v[i];
+        return a;
+    }
+
+    int bits() const {
+        int out = 0;
+        for (int i = 0; i < 4; ++i) out |= (v[i] >> 31) << i;
+        return out;
+    }
+#endif
+
+    bool any() const { return bits() != 0; }
+
+    bool all() const { return bits() == 0xf; }
+
+    bool operator[](int i) const { return (bits() >> i) & 1; }
+};
+
+
+struct alignas(16) float4 {
+#ifdef RAYTRACER_SSE
+    __m128 v;
+
+    float4() : v(_mm_setzero_ps()) {}
+
+    explicit float4(__m128 v_) : v(v_) {}
+
+    float4(float k) : v(_mm_set1_ps(k)) {}
+
+    float4(float a, float b, float c, float d) : v(_mm_setr_ps(a, b, c, d)) {}
+
+    static float4 load(const float *p) { return float4(_mm_load_ps(p)); }
+
+    void store(float *p) const { _mm_store_ps(p, v); }
+
+    float operator[](int i) const {
+        alignas(16) float out[4];
+        store(out);
+        return out[i];
+    }
+
+    friend float4 operator+(float4 a, float4 b) { return float4(_mm_add_ps(a.v, b.v)); }
+
+    friend float4 operator-(float4 a, float4 b) { return float4(_mm_sub_ps(a.v, b.v)); }
+
+    friend float4 operator*(float4 a, float4 b) { return float4(_mm_mul_ps(a.v, b.v)); }
+
+    friend float4 operator/(float4 a, float4 b) { return float4(_mm_div_ps(a.v, b.v)); }
+
+    friend float4 operator-(float4 a) { return float4(_mm_xor_ps(a.v, _mm_set1_ps(-0.f))); }
+
+    friend mask4 operator<(float4 a, float4 b) { return mask4(_mm_cmplt_ps(a.v, b.v)); }
+
+    friend mask4 operator<=(float4 a, float4 b) { return mask4(_mm_cmple_ps(a.v, b.v)); }
+
+    friend mask4 operator>(float4 a, float4 b) { return mask4(_mm_cmpgt_ps(a.v, b.v)); }
+
+    friend mask4 operator>=(float4 a, float4 b) { return mask4(_mm_cmpge_ps(a.v, b.v)); }
+
+    friend float4 min(float4 a, float4 b) { return float4(_mm_min_ps(a.v, b.v)); }
+
+    friend float4 max(float4 a, float4 b) { return float4(_mm_max_ps(a.v, b.v)); }
+
+    friend float4 abs(float4 a) { return float4(_mm_andnot_ps(_mm_set1_ps(-0.f), a.v)); }
+
+    friend float4 sqrt(float4 a) { return float4(_mm_sqrt_ps(a.v)); }
+
+    // m ? a : b per lane
+    friend float4 select(mask4 m, float4 a, float4 b) {
+        return float4(_mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)));
+    }
+#else
+    float v[4];
+
+    float4() : v() {}
+
+    float4(float k) : v{k, k, k, k} {}
+
+    float4(float a, float b, float c, float d) : v{a, b, c, d} {}
+
+    static float4 load(const float *p) { return float4(p[0], p[1], p[2], p[3]); }
+
+    void store(float *p) const { std::copy(v, v + 4, p); }
+
+    float operator[](int i) const { return v[i]; }
+
+    template <typename Op>
+    static float4 map(float4 a, float4 b, Op op) {
+        for (int i = 0; i < 4; ++i) a.v[i] = op(a.v[i], b.v[i]);
+        return a;
+    }
+
+    template <typename Op>
+    static mask4 compare(float4 a, float4 b, Op op) {
+        mask4 m;
+        for (int i = 0; i < 4; ++i) m.v[i] = op(a.v[i], b.v[i]) ? ~0u : 0u;
+        return m;
+    }
+
+    friend float4 operator+(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x + y; }); }
+
+    friend float4 operator-(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x - y; }); }
+
+    friend float4 operator*(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x * y; }); }
+
+    friend float4 operator/(float4 a, float4 b) { return map(a, b, [](float x, float y) { return x / y; }); }
+
+    friend float4 operator-(float4 a) {
+        for (float &x : a.v) x = -x;
+        return a;
+    }
+
+    friend mask4 operator<(float4 a, float4 b) { return compare(a, b, [](float x, float y) { return x < y; }); }
+
+    friend mask4 operator<=(float4 a, float4 b) { return compare(a, b, [](float x, float y) { return x <= y; }); }
+
+    friend mask4 operator>(float4 a, float4 b) { return compare(a, b, [](float x, float y) { return x > y; }); }
+
+    friend mask4 operator>=(float4 a, float4 b) { return compare(a, b, [](float x, float y) { return x >= y; }); }
+
+    friend float4 min(float4 a, float4 b) { return map(a, b, [](float x, float y) { return y < x ? y : x; }); }
+
+    friend float4 max(float4 a, float4 b) { return map(a, b, [](float x, float y) { return y > x ? y : x; }); }
+
+    friend float4 abs(float4 a) { return map(a, a, [](float x, float) { return fabsf(x); }); }
+
+    friend float4 sqrt(float4 a) { return map(a, a, [](float x, float) { return sqrtf(x); }); }
+
+    friend float4 select(mask4 m, float4 a, float4 b) {
+        for (int i = 0; i < 4; ++i) if (m.v[i]) b.v[i] = a.v[i];
+        return b;
+    }
+#endif
+
+    float4 &operator+=(float4 b) { return *this = *this + b; }
+
+    float4 &operator-=(float4 b) { return *this = *this - b; }
+
+    float4 &operator*=(float4 b) { return *this = *this * b; }
+
+    // a scalar function of every lane, for what has no vector instruction (cosf, powf, ...)
+    template <typename Func>
+    float4 apply(const Func &func) const {
+        alignas(16) float out[4];
+        store(out);
+        for (float &x : out) x = func(x);
+        return load(out);
+    }
+
+    // std::max and std::min per lane, which unlike max and min keep a NaN in a
+    friend float4 std_max(float4 a, float4 b) { return select(a < b, b, a); }
+
+    friend float4 std_min(float4 a, float4 b) { return select(b < a, b, a); }
+
+    // x y z of a point or direction in the first three lanes
+    template <typename V>
+    static float4 from_xyz(const V &p, float w = 0) { return float4(p.x, p.y, p.z, w); }
+
+    // dot product of the first three lanes
+    friend float dot3(float4 a, float4 b) {
+        float4 p = a * b;
+        return (p[0] + p[1]) + p[2];
+    }
+
+    // largest / smallest of the first three lanes
+    friend float hmax3(float4 a) { return std::max(std::max(a[0], a[1]), a[2]); }
+
+    friend float hmin3(float4 a) { return std::min(std::min(a[0], a[1]), a[2]); }
+};
+
+
+// N points or directions in structure-of-arrays form, one lane each; F is the lane type (float4)
+template <typename F>
+struct Vec3xN {
+    F x, y, z;
+
+    Vec3xN() {}
+
+    Vec3xN(F x_, F y_, F z_) : x(x_), y(y_), z(z_) {}
+
+    // the same vector in every lane
+    template <typename V>
+    static Vec3xN broadcast(const V &v) { return Vec3xN(F(v.x), F(v.y), F(v.z)); }
+
+    friend Vec3xN operator+(const Vec3xN &a, const Vec3xN &b) { return Vec3xN(a.x + b.x, a.y + b.y, a.z + b.z); }
+
+    friend Vec3xN operator-(const Vec3xN &a, const Vec3xN &b) { return Vec3xN(a.x - b.x, a.y - b.y, a.z - b.z); }
+
+    friend Vec3xN operator*(const Vec3xN &a, F k) { return Vec3xN(a.x * k, a.y * k, a.z * k); }
+
+    friend Vec3xN operator*(F k, const Vec3xN &a) { return a * k; }
+
+    // evaluated in the same order as Vector3, so that the lanes match the scalar results bit for bit
+    friend F dot(const Vec3xN &a, const Vec3xN &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+    friend Vec3xN cross(const Vec3xN &a, const Vec3xN &b) {
+        return Vec3xN(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+
+    friend Vec3xN select(mask4 m, const Vec3xN &a, const Vec3xN &b) {
+        return Vec3xN(select(m, a.x, b.x), select(m, a.y, b.y), select(m, a.z, b.z));
+    }
+
+    Vec3xN normalized() const {
+        F len = sqrt(dot(*this, *this));
+        return Vec3xN(x / len, y / len, z / len);
+    }
+
+    template <typename V>
+    V lane(int i) const { return V(x[i], y[i], z[i]); }
+};
+
+typedef Vec3xN<float4> Vec3x4;
+
+
+// Lane-wise versions of the shading and sampling math of RayTracer::ray_trace, each in the same
+// order of operations as its scalar original, so that every lane gives the scalar result.
+
+// s given in the frame (nx, ny, nz)
+template <typename F>
+Vec3xN<F> to_world(const Vec3xN<F> &s, const Vec3xN<F> &nx, const Vec3xN<F> &ny, const Vec3xN<F> &nz) {
+    return Vec3xN<F>(s.x * nx.x + s.y * ny.x + s.z * nz.x,
+                     s.x * nx.y + s.y * ny.y + s.z * nz.y,
+                     s.x * nx.z + s.y * ny.z + s.z * nz.z);
+}
+
+// uniform_sample_hemisphere around +y from the uniform numbers r1 and r2 of every lane
+template <typename F>
+Vec3xN<F> uniform_sample_hemisphere(F r1, F r2) {
+    const F sin_theta = sqrt(F(1.f) - r1 * r1);
+    const F phi = F(2 * static_cast<float>(M_PI)) * r2;
+    return Vec3xN<F>(sin_theta * phi.apply(cosf), r1, sin_theta * phi.apply(sinf));
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Process-wide pool of hardware_concurrency threads, shared by everything that loads a scene: the
+// per asset tasks of Scene::from_json, the chunks of ObjMesh::load and the subtrees of KDTree::build.
+// These nest (a body task parses its mesh and then builds its tree), so a pool thread that waits for
+// a group runs queued tasks meanwhile instead of blocking; other threads block. Either way, no more
+// than hardware_concurrency threads load at a time, however many assets a scene has.
+class TaskPool {
+public:
+    // tasks run together and waited for together; the first exception a task throws is rethrown by wait()
+    class Group {
+    public:
+        Group() : pool(TaskPool::instance()), num_pending(0) {}
+
+        Group(const Group &) = delete;
+
+        Group &operator=(const Group &) = delete;
+
+        ~Group() {
+            try { wait(); } catch (...) {}
+        }
+
+        void run(std::function<void()> task) { pool.push(*this, std::move(task)); }
+
+        void wait() {
+            pool.wait(*this);
+            std::exception_ptr e;
+            std::swap(e, error);
+            if (e) std::rethrow_exception(e);
+        }
+
+    private:
+        friend class TaskPool;
+        TaskPool &pool;
+        int num_pending;   // guarded by pool.mutex
+        std::exception_ptr error;
+    };
+
+    static TaskPool &instance() {
+        static TaskPool pool;
+        return pool;
+    }
+
+    int num_threads() const { return static_cast<int>(threads.size()); }
+
+    ~TaskPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+private:
+    struct Task {
+        Group *group;
+        std::function<void()> func;
+    };
+
+    std::mutex mutex;
+    std::condition_variable changed;   // a task was queued or finished
+    std::deque<Task> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    TaskPool() {
+        const unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < n; ++i)
+            threads.emplace_back([this] {
+                is_pool_thread() = true;
+                std::unique_lock<std::mutex> lock(mutex);
+                for (;;) {
+                    changed.wait(lock, [this] { return stopping || !queue.empty(); });
+                    if (queue.empty()) return;
+                    run_front(lock);
+                }
+            });
+    }
+
+    static bool &is_pool_thread() {
+        static thread_local bool pool_thread = false;
+        return pool_thread;
+    }
+
+    void push(Group &group, std::function<void()> func) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++group.num_pending;
+            queue.push_back(Task{&group, std::move(func)});
+        }
+        changed.notify_all();
+    }
+
+    // runs the oldest task with the lock released
+    void run_front(std::unique_lock<std::mutex> &lock) {
+        Task task = std::move(queue.front());
+        queue.pop_front();
+        lock.unlock();
+        std::exception_ptr e;
+        try {
+            task.func();
+        } catch (...) {
+            e = std::current_exception();
+        }
+        lock.lock();
+        if (e && !task.group->error) task.group->error = e;
+        --task.group->num_pending;
+        changed.notify_all();
+    }
+
+    void wait(Group &group) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const bool help = is_pool_thread();
+        while (group.num_pending > 0) {
+            if (help && !queue.empty()) run_front(lock);
+            else changed.wait(lock);
+        }
+    }
+};
@@ -2,9 +2,9 @@
 #include "raytracer.hpp"
 
 void add_scene2(RayTracer &tracer) {
-    GridTexture *texture_grid = new GridTexture(Color(0, 0, 0), Color(1, 1, 1));
-    PNGTexture *texture_ground = new PNGTexture("../resources/ground.png");
-    PNGTexture *texture_watermelon = new PNGTexture("../resources/watermelon.png");
+    TextureRegistry &textures = tracer.scene.textures;
+    Texture *texture_grid = textures.acquire(GridTexture(Color(0, 0, 0), Color(1, 1, 1)).to_json());
+    Texture *texture_ground = textures.acquire({{"type", "PNGTexture"}, {"filename", "../resources/ground.png"}});
 
     Material plane_material = {
             .color = Color(1, 1, 1),
@@ -0,0 +1,417 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "denoiser.hpp"
+#include "geometry.hpp"
+
+// Wavefront version of RayTracer::ray_trace. Instead of recursing, a tile is traced one bounce
+// at a time: all rays of the bounce are intersected in one pass (extend), then all hits are shaded
+// in another pass (shade), which queues the shadow rays and the rays of the next bounce, and
+// finally all shadow rays are tested (shadow). Every ray carries the weight with which its color
+// adds to its pixel, so the result is the same sum ray_trace computes, up to rounding.
+// The queues are kept per thread and reused from tile to tile.
+// With config.sort_secondary, the bounce rays are traced in an order that groups rays of similar
+// direction and origin, so that consecutive traversals touch the same k-d tree nodes.
+struct WavefrontIntegrator {
+    const Scene &scene;
+    const TraceConfig config;
+
+    WavefrontIntegrator(const Scene &scene_, const TraceConfig &config_) : scene(scene_), config(config_) {}
+
+    // Pixel (x, y) goes to out[(y - origin_y) * out_stride + x - origin_x]. With radiance_out, the
+    // colors go there unclamped instead, and aux gets the primary hits; both are aux->width wide.
+    // With hit_cache, the primary hits are taken from it if it is valid, and stored in it otherwise.
+    // With cost_out, every pixel gets the config.cost_metric of the rays traced and the hits shaded
+    // for it, at cost_out[(y - origin_y) * cost_stride + x - origin_x]. Only the pixels of
+    // config.traces_pixel are traced and written; returns how many.
+    int render_tile(const Camera::Screen &screen, int x0, int y0, int x1, int y1, uint8_t *out, int out_stride,
+                     int origin_x, int origin_y, Color *radiance_out = nullptr, AuxBuffers *aux = nullptr,
+                     PrimaryHitCache *hit_cache = nullptr, float *cost_out = nullptr, int cost_stride = 0) {
+        const int tile_width = x1 - x0;
+        radiance.assign(static_cast<size_t>(tile_width) * (y1 - y0), Color(0, 0, 0));
+        measure_cost = cost_out != nullptr;
+        if (measure_cost) cost.assign(radiance.size(), 0);
+
+        // generate
+        paths.clear();
+        const bool trace_primary = !hit_cache || !hit_cache->valid;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                if (!config.traces_pixel(x, y)) continue;
+                const uint32_t pixel = static_cast<uint32_t>((y - y0) * tile_width + (x - x0));
+                measured(pixel, [&] {
+                    const Ray ray = screen.ray(x, y);
+                    if (trace_primary) {
+                        RenderStats::count_ray(RenderStats::PRIMARY);
+                        RayCapture::record(ray, RenderStats::PRIMARY);
+                    }
+                    paths.push(ray, Color(1, 1, 1), pixel, 1, 1.f, 1.f);
+                });
+            }
+        }
+
+        const int num_traced = static_cast<int>(paths.size());
+        for (bool primary = true; paths.size(); primary = false) {
+            if (primary && hit_cache) extend_cached(*hit_cache, x0, y0, tile_width);
+            else extend();
+            // the primary rays are queued in pixel order
+            if (primary && aux) primary_hits = hits;
+            next.clear();
+            shadows.clear();
+            shade();
+            shadow();
+            std::swap(paths, next);
+        }
+
+        // the primary hits are in the order of the traced pixels
+        for (int y = y0, k = 0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                if (!config.traces_pixel(x, y)) continue;
+                const size_t i = (y - y0) * tile_width + (x - x0);
+                if (radiance_out) {
+                    const size_t idx = static_cast<size_t>(y - origin_y) * aux->width + (x - origin_x);
+                    radiance_out[idx] = radiance[i];
+                    aux->set(idx, scene, screen.ray(x, y), primary_hits[k].primitive, primary_hits[k].distance);
+                    ++k;
+                } else {
+                    color_save_to_array(&out[(static_cast<size_t>(y - origin_y) * out_stride + (x - origin_x)) * 3],
+                                        radiance[i]);
+                }
+                if (measure_cost) cost_out[static_cast<size_t>(y - origin_y) * cost_stride + (x - origin_x)] = cost[i];
+            }
+        }
+        return num_traced;
+    }
+
+private:
+    // the rays of one bounce, with the state of their paths
+    struct PathQueue {
+        std::vector<Ray> rays;
+        std::vector<Color> weight;              // of the ray's color in its pixel
+        std::vector<uint32_t> pixel;            // in the tile
+        std::vector<int> depth;
+        std::vector<float> refract_index;       // of the medium the ray travels in
+        std::vector<float> light_sample_scale;  // of config.num_light_sample_per_unit
+
+        size_t size() const { return rays.size(); }
+
+        void clear() {
+            rays.clear(), weight.clear(), pixel.clear(), depth.clear();
+            refract_index.clear(), light_sample_scale.clear();
+        }
+
+        void push(const Ray &ray, const Color &weight_, uint32_t pixel_, int depth_,
+                  float refract_index_, float light_sample_scale_) {
+            rays.push_back(ray);
+            weight.push_back(weight_);
+            pixel.push_back(pixel_);
+            depth.push_back(depth_);
+            refract_index.push_back(refract_index_);
+            light_sample_scale.push_back(light_sample_scale_);
+        }
+    };
+
+    // a shadow ray adds `contribution` to its pixel if the first thing it hits is `light`
+    struct ShadowQueue {
+        std::vector<Ray> rays;
+        std::vector<const Primitive *> light;
+        std::vector<int> sample;                // of the light, the ray goes toward
+        std::vector<Color> contribution;
+        std::vector<uint32_t> pixel;
+
+        size_t size() const { return rays.size(); }
+
+        void clear() { rays.clear(), light.clear(), sample.clear(), contribution.clear(), pixel.clear(); }
+
+        void push(const Ray &ray, const Primitive *light_, int sample_, const Color &contribution_, uint32_t pixel_) {
+            rays.push_back(ray);
+            light.push_back(light_);
+            sample.push_back(sample_);
+            contribution.push_back(contribution_);
+            pixel.push_back(pixel_);
+        }
+    };
+
+    PathQueue paths, next;
+    ShadowQueue shadows;
+    std::vector<FindNearestResult> hits;    // of paths.rays
+    std::vector<FindNearestResult> primary_hits;    // of the tile's traced pixels
+    std::vector<uint64_t> order;            // sort key << 32 | index into paths
+    std::vector<Color> radiance;            // of the tile
+    std::vector<float> cost;                // of the tile, with measure_cost
+    bool measure_cost = false;
+
+    // does func and adds what it cost to the pixel of the tile
+    template <typename Func>
+    void measured(uint32_t pixel, const Func &func) {
+        if (!measure_cost) {
+            func();
+            return;
+        }
+        const uint64_t start = cost_counter(config);
+        func();
+        cost[pixel] += static_cast<float>(cost_counter(config) - start);
+    }
+
+    // Rays next to each other in the queue (or in the sorted order) go through the k-d trees four at
+    // a time, as a packet; measuring a cost per pixel needs one ray at a time.
+    void extend() {
+        hits.resize(paths.size());
+        // primary rays are coherent already
+        const bool sorted = config.sort_secondary && paths.depth[0] > 1;
+        // the hits stay at the ray's index, so shading order (and random sampling) does not change
+        if (sorted) sort_rays();
+        auto index = [&](size_t k) { return sorted ? static_cast<uint32_t>(order[k]) : static_cast<uint32_t>(k); };
+        if (measure_cost) {
+            for (size_t k = 0; k < paths.size(); ++k) {
+                const uint32_t i = index(k);
+                measured(paths.pixel[i], [&] { hits[i] = scene.find_nearest(paths.rays[i]); });
+            }
+            return;
+        }
+        for (size_t k = 0; k < paths.size(); k += 4) {
+            const int n = static_cast<int>(std::min<size_t>(4, paths.size() - k));
+            uint32_t idx[4];
+            const Ray *rays[4];
+            FindNearestResult res[4];
+            for (int lane = 0; lane < n; ++lane) idx[lane] = index(k + lane), rays[lane] = &paths.rays[idx[lane]];
+            scene.find_nearest4(rays, n, res);
+            for (int lane = 0; lane < n; ++lane) hits[idx[lane]] = res[lane];
+        }
+    }
+
+    // the primary rays of the tile at (x0, y0), tile_width wide
+    void extend_cached(PrimaryHitCache &hit_cache, int x0, int y0, int tile_width) {
+        auto cached = [&](size_t i) -> FindNearestResult & {
+            return hit_cache.at(x0 + static_cast<int>(paths.pixel[i]) % tile_width,
+                                y0 + static_cast<int>(paths.pixel[i]) / tile_width);
+        };
+        if (!hit_cache.valid && !measure_cost) {
+            extend();
+            for (size_t i = 0; i < paths.size(); ++i) cached(i) = hits[i];
+            return;
+        }
+        hits.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); ++i) {
+            FindNearestResult &hit = cached(i);
+            if (!hit_cache.valid) measured(paths.pixel[i], [&] { hit = scene.find_nearest(paths.rays[i]); });
+            hits[i] = hit;
+        }
+    }
+
+    // spreads the low 10 bits of v to every third bit
+    static uint32_t part1by2(uint32_t v) {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    // key: 3 bits of direction octant, then a 30-bit Morton code of the origin within the batch bounds
+    void sort_rays() {
+        Vector3 lo = paths.rays[0].origin, hi = lo;
+        for (const Ray &ray : paths.rays) lo = min(lo, ray.origin), hi = max(hi, ray.origin);
+        Vector3 scale = hi - lo;
+        for (int k = 0; k < 3; ++k) scale.data[k] = scale.data[k] > 0 ? 1023.f / scale.data[k] : 0;
+
+        order.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); ++i) {
+            const Ray &ray = paths.rays[i];
+            const uint32_t octant = (ray.direction.x < 0) | (ray.direction.y < 0) << 1 | (ray.direction.z < 0) << 2;
+            const Vector3 q = (ray.origin - lo) * scale;
+            const uint32_t morton = part1by2(static_cast<uint32_t>(q.x)) | part1by2(static_cast<uint32_t>(q.y)) << 1 |
+                                    part1by2(static_cast<uint32_t>(q.z)) << 2;
+            order[i] = static_cast<uint64_t>(octant << 30 | morton) << 32 | i;
+        }
+        std::sort(order.begin(), order.end());
+    }
+
+    void shade() {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            const FindNearestResult &hit = hits[i];
+            if (hit.hit == IntersectionResult::MISS) continue;
+            const Material &material = hit.primitive->material;
+            if (hit.primitive->light)
+                radiance[paths.pixel[i]] += paths.weight[i] * material.color;
+            else
+                measured(paths.pixel[i], [&] { (this->*shade_kernel(material.features))(i); });
+        }
+    }
+
+    typedef void (WavefrontIntegrator::*ShadeKernel)(size_t);
+
+    // like RayTracer::shade_kernel, one instance of shade_path per Material::Feature mask
+    static ShadeKernel shade_kernel(uint32_t features) {
+        static const std::vector<ShadeKernel> table = [] {
+            std::vector<ShadeKernel> t(Material::NUM_FEATURE_MASKS);
+            fill_shade_kernels(t.data());
+            return t;
+        }();
+        return table[features];
+    }
+
+    template <uint32_t Features = 0>
+    static typename std::enable_if<(Features < Material::NUM_FEATURE_MASKS)>::type fill_shade_kernels(ShadeKernel *t) {
+        t[Features] = &WavefrontIntegrator::shade_path<Features>;
+        fill_shade_kernels<Features + 1>(t);
+    }
+
+    template <uint32_t Features>
+    static typename std::enable_if<(Features == Material::NUM_FEATURE_MASKS)>::type fill_shade_kernels(ShadeKernel *) {}
+
+    // shades the hit of paths.rays[i]
+    template <uint32_t Features>
+    void shade_path(size_t i) {
+        const FindNearestResult &hit = hits[i];
+        const Ray &ray = paths.rays[i];
+        const Color &weight = paths.weight[i];
+        const uint32_t pixel = paths.pixel[i];
+        const Primitive *primitive = hit.primitive;
+        const Material &material = primitive->material;
+
+        Vector3 pi = ray.origin + ray.direction * hit.distance;
+        Vector3 N = primitive->get_normal(pi);
+        const float cone_width = ray.cone_width_at(hit.distance);
+        Color color_pi = material.color;
+        if (Features & Material::TEXTURED) {
+            const float footprint = cone_width / std::max(fabsf(N.dot(ray.direction)), 1e-2f);
+            color_pi = primitive->get_color(pi, footprint);
+        }
+        if (Features & (Material::DIFFUSE | Material::SPECULAR))
+            queue_shadow_rays<Features>(paths.light_sample_scale[i], ray, pi, N, material, color_pi, weight, pixel);
+
+        const int depth = paths.depth[i];
+        if (depth + 1 > config.num_trace_depth) return;
+        const float refract_index = paths.refract_index[i];
+        const float light_sample_scale = paths.light_sample_scale[i];
+
+        // reflection
+        if (Features & Material::REFLECT) {
+            if ((Features & Material::DIFFUSE_REFLECT) && depth <= 1) {
+                // diffuse reflection: only primary ray; the frame around N is that of ray_trace, and
+                // the random numbers are drawn in the order of uniform_sample_hemisphere and turned
+                // into directions four at a time
+                const int num_sample = config.num_diffuse_reflect_sample;
+                Vector3 Nx = fabsf(N.x) > fabsf(N.y) ? Vector3(N.z, 0, -N.x) : Vector3(0, -N.z, N.y);
+                Nx = Nx.normalized();
+                const Vector3 Nz = N.cross(Nx).normalized();
+                const Vec3x4 Nx4 = Vec3x4::broadcast(Nx), Ny4 = Vec3x4::broadcast(N), Nz4 = Vec3x4::broadcast(Nz);
+                const Color w = weight * material.k_reflect * color_pi / num_sample;
+                RenderStats::count_ray(RenderStats::DIFFUSE, num_sample);
+                for (int k = 0; k < num_sample; k += 4) {
+                    const int num_lane = std::min(4, num_sample - k);
+                    alignas(16) float r1[4] = {}, r2[4] = {};
+                    for (int lane = 0; lane < num_lane; ++lane) r1[lane] = randf(), r2[lane] = randf();
+                    const Vec3x4 R4 = to_world(uniform_sample_hemisphere(float4::load(r1), float4::load(r2)),
+                                               Nx4, Ny4, Nz4);
+                    for (int lane = 0; lane < num_lane; ++lane) {
+                        const Vector3 R = R4.lane<Vector3>(lane);
+                        const Ray ray_reflect(pi + R * EPS, R, cone_width, ray.cone_spread);
+                        RayCapture::record(ray_reflect, RenderStats::DIFFUSE);
+                        next.push(ray_reflect, w, pixel, depth + 1, refract_index, light_sample_scale * 0.25f);
+                    }
+                }
+            } else {
+                // perfect reflection
+                Vector3 R = ray.direction - 2.f * ray.direction.dot(N) * N;
+                const Ray ray_reflect(pi + R * EPS, R, cone_width, ray.cone_spread);
+                RenderStats::count_ray(RenderStats::REFLECTION);
+                RayCapture::record(ray_reflect, RenderStats::REFLECTION);
+                next.push(ray_reflect, weight * material.k_reflect * color_pi, pixel, depth + 1, refract_index,
+                          light_sample_scale * 0.5f);
+            }
+        }
+
+        // refraction
+        if (Features & Material::REFRACT) {
+            float n = refract_index / material.k_refract_index;
+            Vector3 Nd = hit.hit == IntersectionResult::INSIDE ? -N : N;
+            float cosI = -Nd.dot(ray.direction);
+            float cosT2 = 1.f - n * n * (1.f - cosI * cosI);
+            if (cosT2 > 0) {
+                Vector3 T = n * ray.direction + (n * cosI - sqrtf(cosT2)) * Nd;
+                const Ray ray_refract(pi + T * EPS, T, cone_width, ray.cone_spread);
+                RenderStats::count_ray(RenderStats::REFRACTION);
+                RayCapture::record(ray_refract, RenderStats::REFRACTION);
+                next.push(ray_refract, weight, pixel, depth + 1, material.k_refract_index, light_sample_scale * 0.5f);
+            }
+        }
+    }
+
+    // diffuse and specular shading of every light (or of config.num_light_pick lights picked from
+    // the light tree), which counts in proportion to the visible light samples
+    template <uint32_t Features>
+    void queue_shadow_rays(float light_sample_scale, const Ray &ray, const Vector3 &pi, const Vector3 &N,
+                           const Material &material, const Color &color_pi, const Color &weight, uint32_t pixel) {
+        const float num_light_sample_per_unit = config.num_light_sample_per_unit * light_sample_scale;
+        auto queue_light = [&](const Primitive *light, float light_weight) {
+            int n;
+            Vector3 L(0, 0, 0);
+            if (light->type == Primitive::SPHERE) {
+                n = 1;
+                L = (static_cast<const Sphere *>(light)->center - pi).normalized();
+            } else if (light->type == Primitive::BOX) {
+                n = light->get_num_light_sample(num_light_sample_per_unit);
+                for (int k = 0; k < n; ++k) L += (light->light_samples[k] - pi).normalized();
+                L = L / n;
+            } else {
+                return;
+            }
+            RenderStats::count_light_samples(n);
+
+            Color c(0, 0, 0);
+            if (Features & Material::DIFFUSE) {
+                float dot = N.dot(L);
+                if (dot > 0) c += dot * material.k_diffuse * color_pi * light->material.color;
+            }
+            if (Features & Material::SPECULAR) {
+                Vector3 R = L - 2.f * L.dot(N) * N;
+                float dot = ray.direction.dot(R);
+                if (dot > 0) c += powf(dot, 20) * material.k_specular * light->material.color;
+            }
+            if (c.x == 0 && c.y == 0 && c.z == 0) return;
+
+            const Color contribution = weight * (c * light_weight) / n;
+            if (light->type == Primitive::SPHERE) {
+                const Ray ray_shadow(pi + L * EPS, L);
+                RayCapture::record_shadow(ray_shadow, static_cast<const Sphere *>(light)->center);
+                shadows.push(ray_shadow, light, 0, contribution, pixel);
+            } else {
+                for (int k = 0; k < n; ++k) {
+                    Vector3 Lk = (light->light_samples[k] - pi).normalized();
+                    const Ray ray_shadow(pi + Lk * EPS, Lk);
+                    RayCapture::record_shadow(ray_shadow, light->light_samples[k]);
+                    shadows.push(ray_shadow, light, k, contribution, pixel);
+                }
+            }
+        };
+
+        const int num_pick = config.num_light_pick;
+        if (num_pick > 0 && static_cast<size_t>(num_pick) < scene.lights.size()) {
+            const Vector3 R = ray.direction - 2.f * ray.direction.dot(N) * N;
+            for (int k = 0; k < num_pick; ++k) {
+                float pdf;
+                const Primitive *light = scene.light_tree.sample(pi, N, (Features & Material::SPECULAR) ? &R : nullptr,
+                                                                 randf(), pdf);
+                if (light) queue_light(light, 1.f / (num_pick * pdf));
+            }
+        } else {
+            for (const Primitive *light : scene.lights) queue_light(light, 1.f);
+        }
+    }
+
+    void shadow() {
+        for (size_t i = 0; i < shadows.size(); ++i) {
+            measured(shadows.pixel[i], [&] {
+                RenderStats::count_ray(RenderStats::SHADOW);
+                if (config.shadow_cache ? ShadowCache::visible(scene, shadows.rays[i], shadows.light[i], shadows.sample[i])
+                                        : scene.find_nearest(shadows.rays[i]).primitive == shadows.light[i])
+                    radiance[shadows.pixel[i]] += shadows.contribution[i];
+            });
+        }
+    }
+};